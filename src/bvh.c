@@ -0,0 +1,2192 @@
+#include "bvh.h"
+#include "ray_thread.h"
+
+// Number of centroid bins per axis used by binned SAH builder
+#define BVH_BIN_COUNT 16
+// Subtrees smaller than that are never split between threads
+#define BVH_MIN_TASK_SIZE 4096
+// 30-bit Morton codes are used for primitive counts up to that, 63-bit ones otherwise
+#define BVH_MORTON30_MAX_PRIMS (1 << 20)
+// Primitives sharing that many highest Morton code bits form single cluster in BVHBuildMethod_MortonSAH
+#define BVH_MORTON_CLUSTER_BITS 15
+// Spatial splits are only tried when overlap of children of object split relative to root surface area exceeds that
+#define BVH_SPATIAL_SPLIT_ALPHA 1e-5f
+// Relative costs of traversal step and primitive intersection used in SAH
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 1.0f
+// Leaves can reference up to that many primitives, if SAH says testing them all is cheaper than splitting
+#define BVH_MAX_LEAF_SIZE 8
+
+static char *bvh_build_method_names[] = {
+    "sweep",
+    "binned",
+    "spatial",
+    "lbvh",
+    "hlbvh",
+};
+CT_ASSERT(ARRAY_SIZE(bvh_build_method_names) == BVHBuildMethod_Count);
+
+char *
+bvh_build_method_to_string(BVHBuildMethod method) {
+    assert(method < BVHBuildMethod_Count);
+    return bvh_build_method_names[method];
+}
+
+bool 
+bvh_build_method_from_string(char *string, BVHBuildMethod *method) {
+    bool result = false;
+    for (u32 method_index = 0;
+         method_index < BVHBuildMethod_Count;
+         ++method_index) {
+        if (!strcmp(string, bvh_build_method_names[method_index])) {
+            *method = method_index;
+            result = true;
+            break;
+        }
+    }
+    return result;
+}
+
+static char *bvh_layout_names[] = {
+    "binary",
+    "wide8",
+    "compressed8",
+};
+CT_ASSERT(ARRAY_SIZE(bvh_layout_names) == BVHLayout_Count);
+
+char *
+bvh_layout_to_string(BVHLayout layout) {
+    assert(layout < BVHLayout_Count);
+    return bvh_layout_names[layout];
+}
+
+bool 
+bvh_layout_from_string(char *string, BVHLayout *layout) {
+    bool result = false;
+    for (u32 layout_index = 0;
+         layout_index < BVHLayout_Count;
+         ++layout_index) {
+        if (!strcmp(string, bvh_layout_names[layout_index])) {
+            *layout = layout_index;
+            result = true;
+            break;
+        }
+    }
+    return result;
+}
+
+// Growable storage for nodes and leaf primitive references, used during build.
+// Builder uses malloc instead of arena so final arrays can be copied to arena with exact size
+typedef struct {
+    BVHNode *nodes;
+    u32 node_count;
+    u32 node_capacity;
+
+    u32 *prims;
+    u32 prim_count;
+    u32 prim_capacity;
+} BVHBuildBuffer;
+
+static u32
+bvh_push_node(BVHBuildBuffer *buffer) {
+    if (buffer->node_count + 1 > buffer->node_capacity) {
+        buffer->node_capacity = buffer->node_capacity ? buffer->node_capacity * 2 : 64;
+        buffer->nodes = realloc(buffer->nodes, buffer->node_capacity * sizeof(BVHNode));
+    }
+
+    u32 result = buffer->node_count++;
+    memset(buffer->nodes + result, 0, sizeof(BVHNode));
+    return result;
+}
+
+static void
+bvh_push_prim(BVHBuildBuffer *buffer, u32 index) {
+    if (buffer->prim_count + 1 > buffer->prim_capacity) {
+        buffer->prim_capacity = buffer->prim_capacity ? buffer->prim_capacity * 2 : 64;
+        buffer->prims = realloc(buffer->prims, buffer->prim_capacity * sizeof(u32));
+    }
+
+    buffer->prims[buffer->prim_count++] = index;
+}
+
+static void
+bvh_make_leaf(BVHBuildBuffer *buffer, u32 node_index, BVHPrimitive *prims, u32 n) {
+    BVHNode *node = buffer->nodes + node_index;
+    node->obj_offset = buffer->prim_count;
+    node->nobj = n;
+    for (u32 prim_index = 0;
+         prim_index < n;
+         ++prim_index) {
+        bvh_push_prim(buffer, prims[prim_index].index);
+    }
+}
+
+// split_sah is sum of surface areas of children weighted by their primitive counts.
+// Degenerate nodes without surface area can't be split meaningfully and become leaves too
+static bool 
+bvh_leaf_is_cheaper(u32 n, u32 max_leaf_size, Bounds3 bounds, f32 split_sah) {
+    bool result = false;
+    if (n <= max_leaf_size) {
+        f32 area = bound3s_surface_area(bounds);
+        result = area <= 0.0f || 
+            BVH_INTERSECTION_COST * n <= BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * split_sah / area;
+    }
+    return result;
+}
+
+#define BVH_PRIMITIVE_COMPARATOR(_axis)                                           \
+static int                                                                        \
+bvh_primitive_compare_##_axis(const void *a_v, const void *b_v) {                 \
+    const BVHPrimitive *a = a_v;                                                  \
+    const BVHPrimitive *b = b_v;                                                  \
+    return (a->centroid._axis > b->centroid._axis) -                              \
+           (a->centroid._axis < b->centroid._axis);                               \
+}
+BVH_PRIMITIVE_COMPARATOR(x)
+BVH_PRIMITIVE_COMPARATOR(y)
+BVH_PRIMITIVE_COMPARATOR(z)
+
+// Object-median build. Primitives are sorted along longest axis and SAH is evaluated
+// for every possible split position
+static u32
+bvh_build_sweep(BVHBuildBuffer *buffer, BVHPrimitive *prims, u32 n, f32 *right_area, u32 depth) {
+    assert(n);
+    u32 node_index = bvh_push_node(buffer);
+
+    Bounds3 bounds = bounds3empty();
+    Bounds3 centroid_bounds = bounds3empty();
+    for (u32 prim_index = 0;
+         prim_index < n;
+         ++prim_index) {
+        bounds = bounds3_join(bounds, prims[prim_index].bounds);
+        centroid_bounds = bounds3_extend(centroid_bounds, prims[prim_index].centroid);
+    }
+    buffer->nodes[node_index].bounds = bounds;
+
+    if (n == 1) {
+        bvh_make_leaf(buffer, node_index, prims, n);
+        return node_index;
+    }
+
+    u32 axis = bounds3s_longest_axis(centroid_bounds);
+    if (axis == 0) {
+        qsort(prims, n, sizeof(BVHPrimitive), bvh_primitive_compare_x);
+    } else if (axis == 1) {
+        qsort(prims, n, sizeof(BVHPrimitive), bvh_primitive_compare_y);
+    } else {
+        qsort(prims, n, sizeof(BVHPrimitive), bvh_primitive_compare_z);
+    }
+
+    // Number of primitives in left part
+    u32 split = n / 2;
+    // Too deep trees would overflow traversal stack, so degenerate cases are split in the middle
+    if (depth < BVH_MAX_DEPTH) {
+        Bounds3 right_bounds = bounds3empty();
+        for (u32 prim_index = n - 1;
+             prim_index > 0;
+             --prim_index) {
+            right_bounds = bounds3_join(right_bounds, prims[prim_index].bounds);
+            right_area[prim_index] = bound3s_surface_area(right_bounds);
+        }
+
+        f32 min_sah = INFINITY;
+        Bounds3 left_bounds = bounds3empty();
+        for (u32 prim_index = 0;
+             prim_index < n - 1;
+             ++prim_index) {
+            left_bounds = bounds3_join(left_bounds, prims[prim_index].bounds);
+            f32 sah = (prim_index + 1) * bound3s_surface_area(left_bounds) + (n - prim_index - 1) * right_area[prim_index + 1];
+            if (sah < min_sah) {
+                min_sah = sah;
+                split = prim_index + 1;
+            }
+        }
+        
+        if (bvh_leaf_is_cheaper(n, BVH_MAX_LEAF_SIZE, bounds, min_sah)) {
+            bvh_make_leaf(buffer, node_index, prims, n);
+            return node_index;
+        }
+    }
+
+    bvh_build_sweep(buffer, prims, split, right_area, depth + 1);
+    u32 sec_child_offset = bvh_build_sweep(buffer, prims + split, n - split, right_area, depth + 1);
+    buffer->nodes[node_index].sec_child_offset = sec_child_offset;
+    return node_index;
+}
+
+static u32 
+bvh_bin_index(f32 centroid, f32 bin_min, f32 bin_scale, u32 bin_count) {
+    i32 bin = (i32)((centroid - bin_min) * bin_scale);
+    if (bin < 0) {
+        bin = 0;
+    } else if (bin >= (i32)bin_count) {
+        bin = bin_count - 1;
+    }
+    return bin;
+}
+
+// Splits primitives in the middle along axis. Used in degenerate cases when SAH can't make progress
+static u32
+bvh_median_split(BVHPrimitive *prims, u32 n, u32 axis) {
+    if (axis == 0) {
+        qsort(prims, n, sizeof(BVHPrimitive), bvh_primitive_compare_x);
+    } else if (axis == 1) {
+        qsort(prims, n, sizeof(BVHPrimitive), bvh_primitive_compare_y);
+    } else {
+        qsort(prims, n, sizeof(BVHPrimitive), bvh_primitive_compare_z);
+    }
+    return n / 2;
+}
+
+// Best split of primitives by centroid bins
+typedef struct {
+    f32 sah;
+    u32 axis;
+    // Everything in bins up to this one goes to the left
+    u32 bin;
+    u32 bin_count;
+    Bounds3 left_bounds;
+    Bounds3 right_bounds;
+} BVHObjectSplit;
+
+// Evaluates SAH on centroid bins along all axes. Returns false if primitives can't be separated
+static bool 
+bvh_find_object_split(BVHPrimitive *prims, u32 n, Bounds3 centroid_bounds, BVHObjectSplit *split) {
+    split->sah = INFINITY;
+    // Small nodes don't need many bins, and setting them up would dominate build time
+    u32 bin_count = n < BVH_BIN_COUNT ? n : BVH_BIN_COUNT;
+    split->bin_count = bin_count;
+    for (u32 axis = 0;
+         axis < 3;
+         ++axis) {
+        f32 extent = centroid_bounds.max.e[axis] - centroid_bounds.min.e[axis];
+        if (extent <= 0.0f) {
+            continue;
+        }
+        f32 bin_scale = (f32)bin_count / extent;
+        
+        u32 bin_counts[BVH_BIN_COUNT] = {0};
+        Bounds3 bin_bounds[BVH_BIN_COUNT];
+        for (u32 bin_index = 0;
+             bin_index < bin_count;
+             ++bin_index) {
+            bin_bounds[bin_index] = bounds3empty();
+        }
+        for (u32 prim_index = 0;
+             prim_index < n;
+             ++prim_index) {
+            f32 centroid = prims[prim_index].centroid.e[axis];
+            u32 bin = bvh_bin_index(centroid, centroid_bounds.min.e[axis], bin_scale, bin_count);
+            ++bin_counts[bin];
+            bin_bounds[bin] = bounds3_join(bin_bounds[bin], prims[prim_index].bounds);
+        }
+        
+        // Bounds and count of everything to the right of split after given bin
+        Bounds3 right_bounds[BVH_BIN_COUNT];
+        u32 right_count[BVH_BIN_COUNT];
+        Bounds3 bounds = bounds3empty();
+        u32 count = 0;
+        for (u32 bin_index = bin_count - 1;
+             bin_index > 0;
+             --bin_index) {
+            bounds = bounds3_join(bounds, bin_bounds[bin_index]);
+            count += bin_counts[bin_index];
+            right_bounds[bin_index - 1] = bounds;
+            right_count[bin_index - 1] = count;
+        }
+        
+        bounds = bounds3empty();
+        count = 0;
+        for (u32 bin_index = 0;
+             bin_index < bin_count - 1;
+             ++bin_index) {
+            bounds = bounds3_join(bounds, bin_bounds[bin_index]);
+            count += bin_counts[bin_index];
+            if (!count || !right_count[bin_index]) {
+                continue;
+            }
+            
+            f32 sah = count * bound3s_surface_area(bounds) + right_count[bin_index] * bound3s_surface_area(right_bounds[bin_index]);
+            if (sah < split->sah) {
+                split->sah = sah;
+                split->axis = axis;
+                split->bin = bin_index;
+                split->left_bounds = bounds;
+                split->right_bounds = right_bounds[bin_index];
+            }
+        }
+    }
+    return split->sah < INFINITY;
+}
+
+// Partitions primitives in place. Returns number of primitives in left part
+static u32
+bvh_partition_object_split(BVHPrimitive *prims, u32 n, Bounds3 centroid_bounds, BVHObjectSplit *split) {
+    f32 bin_min = centroid_bounds.min.e[split->axis];
+    f32 bin_scale = (f32)split->bin_count / (centroid_bounds.max.e[split->axis] - bin_min);
+    u32 left = 0;
+    u32 right = n;
+    while (left < right) {
+        f32 centroid = prims[left].centroid.e[split->axis];
+        if (bvh_bin_index(centroid, bin_min, bin_scale, split->bin_count) <= split->bin) {
+            ++left;
+        } else {
+            --right;
+            BVHPrimitive temp = prims[left];
+            prims[left] = prims[right];
+            prims[right] = temp;
+        }
+    }
+    return left;
+}
+
+typedef struct {
+    BVHClipProc *clip;
+    void *clip_data;
+    f32 root_area;
+    u32 ref_count;
+    u32 max_ref_count;
+} BVHSpatialBuilder;
+
+// Clipping part of reference that lies on other side of plane gives empty bounds
+static inline bool
+bvh_bounds_is_empty(Bounds3 bounds) {
+    return bounds.min.x > bounds.max.x || bounds.min.y > bounds.max.y || bounds.min.z > bounds.max.z;
+}
+
+// Splits reference with plane. Resulting bounds never exceed bounds of original reference
+static void
+bvh_split_reference(BVHSpatialBuilder *builder, BVHPrimitive *ref, u32 axis, f32 position, 
+                    BVHPrimitive *left, BVHPrimitive *right) {
+    *left = *right = *ref;
+    if (builder->clip) {
+        builder->clip(builder->clip_data, ref->index, axis, position, &left->bounds, &right->bounds);
+        for (u32 a = 0;
+             a < 3;
+             ++a) {
+            left->bounds.min.e[a] = max32(left->bounds.min.e[a], ref->bounds.min.e[a]);
+            left->bounds.max.e[a] = min32(left->bounds.max.e[a], ref->bounds.max.e[a]);
+            right->bounds.min.e[a] = max32(right->bounds.min.e[a], ref->bounds.min.e[a]);
+            right->bounds.max.e[a] = min32(right->bounds.max.e[a], ref->bounds.max.e[a]);
+        }
+    }
+    left->bounds.max.e[axis] = min32(left->bounds.max.e[axis], position);
+    right->bounds.min.e[axis] = max32(right->bounds.min.e[axis], position);
+    left->centroid = bounds3_center(left->bounds);
+    right->centroid = bounds3_center(right->bounds);
+}
+
+// Best split of references with plane
+typedef struct {
+    f32 sah;
+    u32 axis;
+    f32 position;
+    // Bins of search, partition classifies references by same bins so its counts match ones of search.
+    // Plane is between bin and bin + 1
+    f32 bin_min;
+    f32 bin_width;
+    f32 bin_scale;
+    u32 bin;
+    // Number of references that would be duplicated
+    u32 duplicate_count;
+} BVHSpatialSplit;
+
+// Range of bins reference overlaps along axis. Reference that only touches boundary of next bin is not counted in it,
+// otherwise ones lying on bin boundaries, like axis-aligned quads, would be counted on both sides of split there
+static void
+bvh_reference_bins(Bounds3 bounds, u32 axis, f32 bin_min, f32 bin_width, f32 bin_scale, u32 *first_bin, u32 *last_bin) {
+    u32 first = bvh_bin_index(bounds.min.e[axis], bin_min, bin_scale, BVH_BIN_COUNT);
+    u32 last = bvh_bin_index(bounds.max.e[axis], bin_min, bin_scale, BVH_BIN_COUNT);
+    while (last > first && bounds.max.e[axis] <= bin_min + last * bin_width) {
+        --last;
+    }
+    while (first < last && bounds.min.e[axis] >= bin_min + (first + 1) * bin_width) {
+        ++first;
+    }
+    *first_bin = first;
+    *last_bin = last;
+}
+
+// Bins references by their bounds along all axes, clipping straddling ones by bin boundaries.
+// Split position is chosen among bin boundaries
+static bool
+bvh_find_spatial_split(BVHSpatialBuilder *builder, BVHPrimitive *refs, u32 n, Bounds3 bounds, BVHSpatialSplit *split) {
+    split->sah = INFINITY;
+    for (u32 axis = 0;
+         axis < 3;
+         ++axis) {
+        f32 bin_min = bounds.min.e[axis];
+        f32 extent = bounds.max.e[axis] - bin_min;
+        if (extent <= 0.0f) {
+            continue;
+        }
+        f32 bin_width = extent / BVH_BIN_COUNT;
+        f32 bin_scale = 1.0f / bin_width;
+        
+        // References entering and exiting at given bin
+        u32 entries[BVH_BIN_COUNT] = {0};
+        u32 exits[BVH_BIN_COUNT] = {0};
+        Bounds3 bin_bounds[BVH_BIN_COUNT];
+        for (u32 bin_index = 0;
+             bin_index < BVH_BIN_COUNT;
+             ++bin_index) {
+            bin_bounds[bin_index] = bounds3empty();
+        }
+        for (u32 ref_index = 0;
+             ref_index < n;
+             ++ref_index) {
+            BVHPrimitive ref = refs[ref_index];
+            u32 first_bin, last_bin;
+            bvh_reference_bins(ref.bounds, axis, bin_min, bin_width, bin_scale, &first_bin, &last_bin);
+            ++entries[first_bin];
+            ++exits[last_bin];
+            for (u32 bin_index = first_bin;
+                 bin_index < last_bin;
+                 ++bin_index) {
+                BVHPrimitive left, right;
+                bvh_split_reference(builder, &ref, axis, bin_min + (bin_index + 1) * bin_width, &left, &right);
+                bin_bounds[bin_index] = bounds3_join(bin_bounds[bin_index], left.bounds);
+                ref = right;
+            }
+            bin_bounds[last_bin] = bounds3_join(bin_bounds[last_bin], ref.bounds);
+        }
+        
+        Bounds3 right_bounds[BVH_BIN_COUNT];
+        u32 right_count[BVH_BIN_COUNT];
+        Bounds3 acc = bounds3empty();
+        u32 count = 0;
+        for (u32 bin_index = BVH_BIN_COUNT - 1;
+             bin_index > 0;
+             --bin_index) {
+            acc = bounds3_join(acc, bin_bounds[bin_index]);
+            count += exits[bin_index];
+            right_bounds[bin_index - 1] = acc;
+            right_count[bin_index - 1] = count;
+        }
+        
+        acc = bounds3empty();
+        count = 0;
+        for (u32 bin_index = 0;
+             bin_index < BVH_BIN_COUNT - 1;
+             ++bin_index) {
+            acc = bounds3_join(acc, bin_bounds[bin_index]);
+            count += entries[bin_index];
+            // Split that doesn't reduce reference count on both sides would never terminate
+            if (!count || !right_count[bin_index] || count == n || right_count[bin_index] == n) {
+                continue;
+            }
+            
+            f32 sah = count * bound3s_surface_area(acc) + right_count[bin_index] * bound3s_surface_area(right_bounds[bin_index]);
+            if (sah < split->sah) {
+                split->sah = sah;
+                split->axis = axis;
+                split->position = bin_min + (bin_index + 1) * bin_width;
+                split->bin_min = bin_min;
+                split->bin_width = bin_width;
+                split->bin_scale = bin_scale;
+                split->bin = bin_index;
+                split->duplicate_count = count + right_count[bin_index] - n;
+            }
+        }
+    }
+    return split->sah < INFINITY;
+}
+
+static u32 
+bvh_build_spatial(BVHSpatialBuilder *builder, BVHBuildBuffer *buffer, BVHPrimitive *refs, u32 n, u32 depth) {
+    assert(n);
+    u32 node_index = bvh_push_node(buffer);
+
+    Bounds3 bounds = bounds3empty();
+    Bounds3 centroid_bounds = bounds3empty();
+    for (u32 ref_index = 0;
+         ref_index < n;
+         ++ref_index) {
+        bounds = bounds3_join(bounds, refs[ref_index].bounds);
+        centroid_bounds = bounds3_extend(centroid_bounds, refs[ref_index].centroid);
+    }
+    buffer->nodes[node_index].bounds = bounds;
+
+    if (n == 1) {
+        bvh_make_leaf(buffer, node_index, refs, n);
+        return node_index;
+    }
+    
+    BVHObjectSplit object_split = {0};
+    bool has_object_split = false;
+    BVHSpatialSplit spatial_split = {0};
+    bool use_spatial_split = false;
+    if (depth < BVH_MAX_DEPTH) {
+        has_object_split = bvh_find_object_split(refs, n, centroid_bounds, &object_split);
+        // Spatial splits only make sense if children of object split overlap
+        f32 overlap_area = 0.0f;
+        if (has_object_split) {
+            Bounds3 overlap;
+            overlap.min = v3(max32(object_split.left_bounds.min.x, object_split.right_bounds.min.x),
+                             max32(object_split.left_bounds.min.y, object_split.right_bounds.min.y),
+                             max32(object_split.left_bounds.min.z, object_split.right_bounds.min.z));
+            overlap.max = v3(min32(object_split.left_bounds.max.x, object_split.right_bounds.max.x),
+                             min32(object_split.left_bounds.max.y, object_split.right_bounds.max.y),
+                             min32(object_split.left_bounds.max.z, object_split.right_bounds.max.z));
+            if (overlap.min.x <= overlap.max.x && overlap.min.y <= overlap.max.y && overlap.min.z <= overlap.max.z) {
+                overlap_area = bound3s_surface_area(overlap);
+            }
+        }
+        
+        if ((!has_object_split || overlap_area > BVH_SPATIAL_SPLIT_ALPHA * builder->root_area) &&
+            builder->ref_count < builder->max_ref_count) {
+            if (bvh_find_spatial_split(builder, refs, n, bounds, &spatial_split) &&
+                (!has_object_split || spatial_split.sah < object_split.sah) &&
+                builder->ref_count + spatial_split.duplicate_count <= builder->max_ref_count) {
+                use_spatial_split = true;
+            }
+        }
+    }
+    
+    f32 split_sah = use_spatial_split ? spatial_split.sah : has_object_split ? object_split.sah : INFINITY;
+    if (bvh_leaf_is_cheaper(n, BVH_MAX_LEAF_SIZE, bounds, split_sah) || 
+        (!has_object_split && !use_spatial_split && n <= BVH_MAX_LEAF_SIZE)) {
+        bvh_make_leaf(buffer, node_index, refs, n);
+        return node_index;
+    }
+    
+    u32 sec_child_offset;
+    BVHPrimitive *left = 0;
+    BVHPrimitive *right = 0;
+    u32 left_count = 0;
+    u32 right_count = 0;
+    if (use_spatial_split) {
+        // References straddling plane go to both sides, so children get their own arrays
+        left = malloc(n * sizeof(BVHPrimitive));
+        right = malloc(n * sizeof(BVHPrimitive));
+        u32 duplicate_count = 0;
+        u32 axis = spatial_split.axis;
+        for (u32 ref_index = 0;
+             ref_index < n;
+             ++ref_index) {
+            BVHPrimitive *ref = refs + ref_index;
+            u32 first_bin, last_bin;
+            bvh_reference_bins(ref->bounds, axis, spatial_split.bin_min, spatial_split.bin_width, spatial_split.bin_scale, 
+                               &first_bin, &last_bin);
+            if (last_bin <= spatial_split.bin) {
+                left[left_count++] = *ref;
+            } else if (first_bin > spatial_split.bin) {
+                right[right_count++] = *ref;
+            } else {
+                // Part of reference can be clipped away completely, then it stays on one side only
+                BVHPrimitive left_ref, right_ref;
+                bvh_split_reference(builder, ref, axis, spatial_split.position, &left_ref, &right_ref);
+                bool has_left = !bvh_bounds_is_empty(left_ref.bounds);
+                bool has_right = !bvh_bounds_is_empty(right_ref.bounds);
+                if (has_left) {
+                    left[left_count++] = left_ref;
+                }
+                if (has_right) {
+                    right[right_count++] = right_ref;
+                }
+                if (!has_left && !has_right) {
+                    left[left_count++] = *ref;
+                }
+                duplicate_count += has_left && has_right;
+            }
+        }
+        
+        if (left_count && right_count) {
+            builder->ref_count += duplicate_count;
+        } else {
+            // References touching plane can all end up on one side, then object split is used instead
+            free(left);
+            free(right);
+            use_spatial_split = false;
+        }
+    }
+    
+    if (use_spatial_split) {
+        bvh_build_spatial(builder, buffer, left, left_count, depth + 1);
+        free(left);
+        sec_child_offset = bvh_build_spatial(builder, buffer, right, right_count, depth + 1);
+        free(right);
+    } else {
+        u32 split;
+        if (has_object_split) {
+            split = bvh_partition_object_split(refs, n, centroid_bounds, &object_split);
+        } else {
+            split = bvh_median_split(refs, n, bounds3s_longest_axis(centroid_bounds));
+        }
+        assert(split && split < n);
+        
+        bvh_build_spatial(builder, buffer, refs, split, depth + 1);
+        sec_child_offset = bvh_build_spatial(builder, buffer, refs + split, n - split, depth + 1);
+    }
+    buffer->nodes[node_index].sec_child_offset = sec_child_offset;
+    return node_index;
+}
+
+// Spreads lower 10 bits of value so there are 2 zero bits between each of them
+static inline u32 
+bvh_morton_expand10(u32 v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v <<  8)) & 0x0300F00F;
+    v = (v | (v <<  4)) & 0x030C30C3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// Spreads lower 21 bits of value so there are 2 zero bits between each of them
+static inline u64 
+bvh_morton_expand21(u64 v) {
+    v &= 0x1FFFFF;
+    v = (v | (v << 32)) & 0x001F00000000FFFFull;
+    v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+    v = (v | (v <<  8)) & 0x100F00F00F00F00Full;
+    v = (v | (v <<  4)) & 0x10C30C30C30C30C3ull;
+    v = (v | (v <<  2)) & 0x1249249249249249ull;
+    return v;
+}
+
+static inline u32 
+bvh_count_leading_zeros64(u64 v) {
+    assert(v);
+#if COMPILER_MSVC
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return 63 - index;
+#else 
+    return __builtin_clzll(v);
+#endif 
+}
+
+// Computes Morton code of centroid relative to centroid bounds. Codes are 3 * bits_per_axis bits long
+static u64
+bvh_morton_code(Vec3 centroid, Bounds3 centroid_bounds, u32 bits_per_axis) {
+    f32 cell_count = (f32)(1 << bits_per_axis);
+    u32 cells[3];
+    for (u32 axis = 0;
+         axis < 3;
+         ++axis) {
+        f32 extent = centroid_bounds.max.e[axis] - centroid_bounds.min.e[axis];
+        f32 t = extent > 0.0f ? (centroid.e[axis] - centroid_bounds.min.e[axis]) / extent : 0.0f;
+        f32 cell = t * cell_count;
+        cells[axis] = cell >= cell_count ? (u32)cell_count - 1 : (u32)max32(cell, 0.0f);
+    }
+    
+    u64 result;
+    if (bits_per_axis == 10) {
+        result = (bvh_morton_expand10(cells[0]) << 2) | (bvh_morton_expand10(cells[1]) << 1) | bvh_morton_expand10(cells[2]);
+    } else {
+        assert(bits_per_axis == 21);
+        result = (bvh_morton_expand21(cells[0]) << 2) | (bvh_morton_expand21(cells[1]) << 1) | bvh_morton_expand21(cells[2]);
+    }
+    return result;
+}
+
+// Morton code - primitive index pairs are sorted instead of primitives themselves, 
+// so each pass moves 12 bytes per primitive
+typedef struct {
+    u64 *keys;
+    u32 *values;
+    u64 *temp_keys;
+    u32 *temp_values;
+    u32 n;
+    u32 chunk_size;
+    u32 chunk_count;
+    // Digit of current pass
+    u32 shift;
+    // Digit counts per chunk, turned into scatter offsets between passes
+    u32 (*histograms)[256];
+} BVHRadixSort;
+
+static JOB_PROC_SIGNATURE(bvh_radix_histogram_proc) {
+    BVHRadixSort *sort = param;
+    u32 *histogram = sort->histograms[job_index];
+    memset(histogram, 0, sizeof(u32) * 256);
+    u32 first = job_index * sort->chunk_size;
+    u32 end = first + sort->chunk_size < sort->n ? first + sort->chunk_size : sort->n;
+    for (u32 index = first;
+         index < end;
+         ++index) {
+        ++histogram[(sort->keys[index] >> sort->shift) & 0xFF];
+    }
+}
+
+static JOB_PROC_SIGNATURE(bvh_radix_scatter_proc) {
+    BVHRadixSort *sort = param;
+    u32 *offsets = sort->histograms[job_index];
+    u32 first = job_index * sort->chunk_size;
+    u32 end = first + sort->chunk_size < sort->n ? first + sort->chunk_size : sort->n;
+    for (u32 index = first;
+         index < end;
+         ++index) {
+        u32 dst = offsets[(sort->keys[index] >> sort->shift) & 0xFF]++;
+        sort->temp_keys[dst] = sort->keys[index];
+        sort->temp_values[dst] = sort->values[index];
+    }
+}
+
+// Least significant digit radix sort with 8-bit digits. 
+// Each pass counts digits of chunks in parallel, then scatters chunks in parallel to precomputed offsets
+static void
+bvh_radix_sort(u64 *keys, u32 *values, u32 n, u32 key_bits, u32 thread_count) {
+    BVHRadixSort sort = {0};
+    sort.n = n;
+    sort.chunk_count = thread_count ? thread_count : 1;
+    sort.chunk_size = (n + sort.chunk_count - 1) / sort.chunk_count;
+    sort.histograms = malloc(sizeof(*sort.histograms) * sort.chunk_count);
+    sort.keys = keys;
+    sort.values = values;
+    sort.temp_keys = malloc(sizeof(u64) * n);
+    sort.temp_values = malloc(sizeof(u32) * n);
+    
+    u32 pass_count = (key_bits + 7) / 8;
+    for (u32 pass_index = 0;
+         pass_index < pass_count;
+         ++pass_index) {
+        sort.shift = pass_index * 8;
+        run_parallel_jobs(bvh_radix_histogram_proc, &sort, sort.chunk_count, thread_count);
+        // Chunks with same digit are placed in chunk order, so sort stays stable
+        u32 offset = 0;
+        for (u32 digit = 0;
+             digit < 256;
+             ++digit) {
+            for (u32 chunk_index = 0;
+                 chunk_index < sort.chunk_count;
+                 ++chunk_index) {
+                u32 count = sort.histograms[chunk_index][digit];
+                sort.histograms[chunk_index][digit] = offset;
+                offset += count;
+            }
+        }
+        run_parallel_jobs(bvh_radix_scatter_proc, &sort, sort.chunk_count, thread_count);
+        
+        u64 *temp_keys = sort.keys;
+        sort.keys = sort.temp_keys;
+        sort.temp_keys = temp_keys;
+        u32 *temp_values = sort.values;
+        sort.values = sort.temp_values;
+        sort.temp_values = temp_values;
+    }
+    
+    // After odd number of passes result is in temporary arrays
+    if (sort.keys != keys) {
+        memcpy(keys, sort.keys, sizeof(u64) * n);
+        memcpy(values, sort.values, sizeof(u32) * n);
+        sort.temp_keys = sort.keys;
+        sort.temp_values = sort.values;
+    }
+    free(sort.temp_keys);
+    free(sort.temp_values);
+    free(sort.histograms);
+}
+
+// Subtree, construction of which is postponed so it can be done in parallel
+typedef struct {
+    // Placeholder node in top-level buffer
+    u32 node_index;
+    BVHPrimitive *prims;
+    u32 n;
+    u32 depth;
+    BVHBuildBuffer buffer;
+} BVHBuildTask;
+
+typedef struct {
+    BVHBuildMethod method;
+    // Morton codes of primitives starting from prims, used by BVHBuildMethod_Morton
+    BVHPrimitive *prims;
+    u64 *codes;
+    // Maximum number of primitives in leaf
+    u32 max_leaf_size;
+    // Subtrees with less primitives than that become tasks. If 0, everything is built in place
+    u32 task_size;
+    BVHBuildTask *tasks;
+    u32 task_count;
+    u32 task_capacity;
+} BVHBuilder;
+
+static void
+bvh_push_task(BVHBuilder *builder, u32 node_index, BVHPrimitive *prims, u32 n, u32 depth) {
+    if (builder->task_count + 1 > builder->task_capacity) {
+        builder->task_capacity = builder->task_capacity ? builder->task_capacity * 2 : 64;
+        builder->tasks = realloc(builder->tasks, builder->task_capacity * sizeof(BVHBuildTask));
+    }
+    BVHBuildTask *task = builder->tasks + builder->task_count++;
+    memset(task, 0, sizeof(*task));
+    task->node_index = node_index;
+    task->prims = prims;
+    task->n = n;
+    task->depth = depth;
+}
+
+// Binned SAH build. Centroids are distributed in bins on each axis, and SAH is evaluated only
+// on bin boundaries, so each level is linear in primitive count
+static u32
+bvh_build_binned(BVHBuilder *builder, BVHBuildBuffer *buffer, BVHPrimitive *prims, u32 n, u32 depth) {
+    assert(n);
+    u32 node_index = bvh_push_node(buffer);
+
+    Bounds3 bounds = bounds3empty();
+    Bounds3 centroid_bounds = bounds3empty();
+    for (u32 prim_index = 0;
+         prim_index < n;
+         ++prim_index) {
+        bounds = bounds3_join(bounds, prims[prim_index].bounds);
+        centroid_bounds = bounds3_extend(centroid_bounds, prims[prim_index].centroid);
+    }
+    buffer->nodes[node_index].bounds = bounds;
+
+    if (n == 1) {
+        bvh_make_leaf(buffer, node_index, prims, n);
+        return node_index;
+    }
+    
+    if (builder->task_size && n <= builder->task_size) {
+        bvh_push_task(builder, node_index, prims, n, depth);
+        return node_index;
+    }
+
+    u32 split;
+    BVHObjectSplit object_split = {0};
+    bool has_object_split = depth < BVH_MAX_DEPTH && bvh_find_object_split(prims, n, centroid_bounds, &object_split);
+    // Primitives that can't be separated are split in the middle only if they don't fit in leaf
+    if (bvh_leaf_is_cheaper(n, builder->max_leaf_size, bounds, has_object_split ? object_split.sah : INFINITY) || 
+        (!has_object_split && n <= builder->max_leaf_size)) {
+        bvh_make_leaf(buffer, node_index, prims, n);
+        return node_index;
+    }
+    if (has_object_split) {
+        split = bvh_partition_object_split(prims, n, centroid_bounds, &object_split);
+    } else {
+        split = bvh_median_split(prims, n, bounds3s_longest_axis(centroid_bounds));
+    }
+    assert(split && split < n);
+
+    bvh_build_binned(builder, buffer, prims, split, depth + 1);
+    u32 sec_child_offset = bvh_build_binned(builder, buffer, prims + split, n - split, depth + 1);
+    buffer->nodes[node_index].sec_child_offset = sec_child_offset;
+    return node_index;
+}
+
+// Linear build over primitives sorted by Morton code. 
+// Range is split where highest bit differing between first and last codes changes, found with binary search
+static u32
+bvh_build_morton(BVHBuilder *builder, BVHBuildBuffer *buffer, BVHPrimitive *prims, u32 n, u32 depth) {
+    assert(n);
+    u32 node_index = bvh_push_node(buffer);
+
+    Bounds3 bounds = bounds3empty();
+    for (u32 prim_index = 0;
+         prim_index < n;
+         ++prim_index) {
+        bounds = bounds3_join(bounds, prims[prim_index].bounds);
+    }
+    buffer->nodes[node_index].bounds = bounds;
+
+    if (n == 1) {
+        bvh_make_leaf(buffer, node_index, prims, n);
+        return node_index;
+    }
+    
+    if (builder->task_size && n <= builder->task_size) {
+        bvh_push_task(builder, node_index, prims, n, depth);
+        return node_index;
+    }
+    
+    u64 *codes = builder->codes + (prims - builder->prims);
+    u64 first_code = codes[0];
+    u64 last_code = codes[n - 1];
+    // Number of primitives in left part
+    u32 split = n / 2;
+    // Equal codes can't be separated, so they are split in the middle
+    if (first_code != last_code && depth < BVH_MAX_DEPTH) {
+        u32 common_prefix = bvh_count_leading_zeros64(first_code ^ last_code);
+        // Find last primitive sharing more than common_prefix bits with first one
+        u32 last_left = 0;
+        u32 step = n - 1;
+        do {
+            step = (step + 1) / 2;
+            u32 new_last_left = last_left + step;
+            // Step can go past the end of range, so code is only read once index is known to be inside
+            if (new_last_left < n - 1) {
+                u64 difference = first_code ^ codes[new_last_left];
+                if (!difference || bvh_count_leading_zeros64(difference) > common_prefix) {
+                    last_left = new_last_left;
+                }
+            }
+        } while (step > 1);
+        split = last_left + 1;
+    }
+    assert(split && split < n);
+    
+    // Split position doesn't depend on bounds, so SAH is only evaluated for nodes that can become leaves
+    if (n <= builder->max_leaf_size) {
+        Bounds3 left_bounds = bounds3empty();
+        Bounds3 right_bounds = bounds3empty();
+        for (u32 prim_index = 0;
+             prim_index < n;
+             ++prim_index) {
+            if (prim_index < split) {
+                left_bounds = bounds3_join(left_bounds, prims[prim_index].bounds);
+            } else {
+                right_bounds = bounds3_join(right_bounds, prims[prim_index].bounds);
+            }
+        }
+        f32 split_sah = split * bound3s_surface_area(left_bounds) + (n - split) * bound3s_surface_area(right_bounds);
+        if (bvh_leaf_is_cheaper(n, builder->max_leaf_size, bounds, split_sah)) {
+            bvh_make_leaf(buffer, node_index, prims, n);
+            return node_index;
+        }
+    }
+    
+    bvh_build_morton(builder, buffer, prims, split, depth + 1);
+    u32 sec_child_offset = bvh_build_morton(builder, buffer, prims + split, n - split, depth + 1);
+    buffer->nodes[node_index].sec_child_offset = sec_child_offset;
+    return node_index;
+}
+
+static JOB_PROC_SIGNATURE(bvh_build_task_proc) {
+    BVHBuilder *builder = param;
+    BVHBuildTask *task = builder->tasks + job_index;
+    // Tasks are leaves of top-level tree, so they are built without creating more tasks
+    BVHBuilder task_builder = {0};
+    task_builder.max_leaf_size = builder->max_leaf_size;
+    switch (builder->method) {
+        case BVHBuildMethod_BinnedSAH: {
+            bvh_build_binned(&task_builder, &task->buffer, task->prims, task->n, task->depth);
+        } break;
+        case BVHBuildMethod_Morton: 
+        case BVHBuildMethod_MortonSAH: {
+            task_builder.prims = builder->prims;
+            task_builder.codes = builder->codes;
+            bvh_build_morton(&task_builder, &task->buffer, task->prims, task->n, task->depth);
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+}
+
+// Copies top-level tree to dst in depth-first order, replacing task placeholders with built subtrees.
+// Tasks are created in depth-first order too, so they are met in the same order they are stored
+static u32
+bvh_stitch_tasks(BVHBuildBuffer *dst, BVHBuildBuffer *top, u32 node_index, 
+                 BVHBuilder *builder, u32 *next_task_index) {
+    u32 result = dst->node_count;
+    if (*next_task_index < builder->task_count && 
+        builder->tasks[*next_task_index].node_index == node_index) {
+        BVHBuildTask *task = builder->tasks + (*next_task_index)++;
+        u32 prim_base = dst->prim_count;
+        for (u32 task_node_index = 0;
+             task_node_index < task->buffer.node_count;
+             ++task_node_index) {
+            u32 dst_node_index = bvh_push_node(dst);
+            BVHNode *node = dst->nodes + dst_node_index;
+            *node = task->buffer.nodes[task_node_index];
+            if (node->nobj) {
+                node->obj_offset += prim_base;
+            } else {
+                node->sec_child_offset += result;
+            }
+        }
+        for (u32 prim_index = 0;
+             prim_index < task->buffer.prim_count;
+             ++prim_index) {
+            bvh_push_prim(dst, task->buffer.prims[prim_index]);
+        }
+        free(task->buffer.nodes);
+        free(task->buffer.prims);
+    } else {
+        bvh_push_node(dst);
+        BVHNode node = top->nodes[node_index];
+        if (node.nobj) {
+            u32 obj_offset = dst->prim_count;
+            for (u32 prim_index = node.obj_offset;
+                 prim_index < node.obj_offset + node.nobj;
+                 ++prim_index) {
+                bvh_push_prim(dst, top->prims[prim_index]);
+            }
+            node.obj_offset = obj_offset;
+        } else {
+            bvh_stitch_tasks(dst, top, node_index + 1, builder, next_task_index);
+            node.sec_child_offset = bvh_stitch_tasks(dst, top, node.sec_child_offset, builder, next_task_index);
+        }
+        dst->nodes[result] = node;
+    }
+    return result;
+}
+
+// Converts subtree of binary hierarchy into wide nodes, starting from wide node at wide_index.
+// Children are gathered by opening interior child with largest surface area until node is full.
+// Returns number of wide nodes written
+static u32
+bvh_collapse(BVHNode *nodes, u32 node_index, BVHWideNode *wide_nodes, u32 wide_index) {
+    u32 children[BVH_WIDE_WIDTH];
+    u32 child_count = 0;
+    BVHNode *node = nodes + node_index;
+    if (node->nobj) {
+        children[child_count++] = node_index;
+    } else {
+        children[child_count++] = node_index + 1;
+        children[child_count++] = node->sec_child_offset;
+        while (child_count < BVH_WIDE_WIDTH) {
+            u32 best_child = U32_MAX;
+            f32 best_area = -1.0f;
+            for (u32 child_index = 0;
+                 child_index < child_count;
+                 ++child_index) {
+                BVHNode *child = nodes + children[child_index];
+                f32 area = bound3s_surface_area(child->bounds);
+                if (!child->nobj && area > best_area) {
+                    best_area = area;
+                    best_child = child_index;
+                }
+            }
+            
+            if (best_child == U32_MAX) {
+                break;
+            }
+            
+            u32 opened = children[best_child];
+            children[best_child] = opened + 1;
+            children[child_count++] = nodes[opened].sec_child_offset;
+        }
+    }
+    
+    BVHWideNode *wide = wide_nodes + wide_index;
+    u32 written = 1;
+    wide->child_count = child_count;
+    for (u32 child_index = 0;
+         child_index < BVH_WIDE_WIDTH;
+         ++child_index) {
+        if (child_index < child_count) {
+            BVHNode *child = nodes + children[child_index];
+            wide->min_x[child_index] = child->bounds.min.x;
+            wide->min_y[child_index] = child->bounds.min.y;
+            wide->min_z[child_index] = child->bounds.min.z;
+            wide->max_x[child_index] = child->bounds.max.x;
+            wide->max_y[child_index] = child->bounds.max.y;
+            wide->max_z[child_index] = child->bounds.max.z;
+            wide->nobj[child_index] = child->nobj;
+            if (child->nobj) {
+                wide->child[child_index] = child->obj_offset;
+            } else {
+                wide->child[child_index] = wide_index + written;
+                written += bvh_collapse(nodes, children[child_index], wide_nodes, wide_index + written);
+            }
+        } else {
+            wide->min_x[child_index] = wide->min_y[child_index] = wide->min_z[child_index] = INFINITY;
+            wide->max_x[child_index] = wide->max_y[child_index] = wide->max_z[child_index] = -INFINITY;
+            wide->nobj[child_index] = 0;
+            wide->child[child_index] = 0;
+        }
+    }
+    return written;
+}
+
+// Quantizes child bounds of wide node relative to its own bounds.
+// Rounding is done outwards, so decoded bounds always contain original ones
+static void
+bvh_compress_node(BVHWideNode *wide, BVHCompressedNode *node) {
+    memset(node, 0, sizeof(*node));
+    node->child_count = wide->child_count;
+    
+    f32 *child_min[3] = { wide->min_x, wide->min_y, wide->min_z };
+    f32 *child_max[3] = { wide->max_x, wide->max_y, wide->max_z };
+    u8 *q_min[3] = { node->q_min_x, node->q_min_y, node->q_min_z };
+    u8 *q_max[3] = { node->q_max_x, node->q_max_y, node->q_max_z };
+    for (u32 axis = 0;
+         axis < 3;
+         ++axis) {
+        f32 node_min = INFINITY;
+        f32 node_max = -INFINITY;
+        for (u32 child_index = 0;
+             child_index < wide->child_count;
+             ++child_index) {
+            node_min = min32(node_min, child_min[axis][child_index]);
+            node_max = max32(node_max, child_max[axis][child_index]);
+        }
+        
+        i32 exponent = 0;
+        f32 extent = node_max - node_min;
+        if (extent > 0.0f) {
+            exponent = (i32)ceilf(log2f(extent / 255.0f));
+            while (extent * ldexpf(1.0f, -exponent) > 255.0f) {
+                ++exponent;
+            }
+        }
+        // Keep step in normal float range, so traversal can construct it from bits
+        if (exponent < -126) {
+            exponent = -126;
+        }
+        assert(exponent <= 127);
+        f32 scale = ldexpf(1.0f, exponent);
+        f32 inv_scale = ldexpf(1.0f, -exponent);
+        node->origin.e[axis] = node_min;
+        node->exponent[axis] = exponent;
+        
+        for (u32 child_index = 0;
+             child_index < BVH_WIDE_WIDTH;
+             ++child_index) {
+            if (child_index < wide->child_count) {
+                i32 lo = (i32)floorf((child_min[axis][child_index] - node_min) * inv_scale);
+                i32 hi = (i32)ceilf((child_max[axis][child_index] - node_min) * inv_scale);
+                lo = lo < 0 ? 0 : (lo > 255 ? 255 : lo);
+                hi = hi < 0 ? 0 : (hi > 255 ? 255 : hi);
+                // Subtraction above can round, so make sure decoded bounds are still conservative
+                while (lo > 0 && node_min + lo * scale > child_min[axis][child_index]) {
+                    --lo;
+                }
+                while (hi < 255 && node_min + hi * scale < child_max[axis][child_index]) {
+                    ++hi;
+                }
+                q_min[axis][child_index] = lo;
+                q_max[axis][child_index] = hi;
+            } else {
+                // Unused slot
+                q_min[axis][child_index] = 255;
+                q_max[axis][child_index] = 0;
+            }
+        }
+    }
+    
+    memcpy(node->child, wide->child, sizeof(node->child));
+    memcpy(node->nobj, wide->nobj, sizeof(node->nobj));
+}
+
+f32 
+bvh_sah_cost(BVH *bvh) {
+    f32 result = 0;
+    if (bvh->node_count) {
+        f32 root_area = bound3s_surface_area(bvh->nodes[0].bounds);
+        if (root_area > 0.0f) {
+            for (u32 node_index = 0;
+                 node_index < bvh->node_count;
+                 ++node_index) {
+                BVHNode *node = bvh->nodes + node_index;
+                f32 area = bound3s_surface_area(node->bounds) / root_area;
+                if (node->nobj) {
+                    result += area * node->nobj * BVH_INTERSECTION_COST;
+                } else {
+                    result += area * BVH_TRAVERSAL_COST;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+// Split axis is derived from child bounds instead of being recorded by builders, 
+// so it stays valid after treelet optimization and refits
+static void
+bvh_assign_split_axes(BVHNode *nodes, u32 node_count) {
+    for (u32 node_index = 0;
+         node_index < node_count;
+         ++node_index) {
+        BVHNode *node = nodes + node_index;
+        if (!node->nobj) {
+            Vec3 first = bounds3_center(nodes[node_index + 1].bounds);
+            Vec3 second = bounds3_center(nodes[node->sec_child_offset].bounds);
+            u32 axis = 0;
+            for (u32 a = 1;
+                 a < 3;
+                 ++a) {
+                if (abs32(second.e[a] - first.e[a]) > abs32(second.e[axis] - first.e[axis])) {
+                    axis = a;
+                }
+            }
+            node->split_axis = axis;
+            if (first.e[axis] > second.e[axis]) {
+                node->split_axis |= BVH_SPLIT_AXIS_FLIPPED;
+            }
+        }
+    }
+}
+
+// Nodes are stored in depth-first order, so subtree occupies contiguous range of nodes,
+// which ends after last node in chain of second children
+static u32 
+bvh_subtree_end(BVHNode *nodes, u32 node_index) {
+    while (!nodes[node_index].nobj) {
+        node_index = nodes[node_index].sec_child_offset;
+    }
+    return node_index + 1;
+}
+
+// Refits nodes in range in reverse order, so children are always refitted before parents
+static void
+bvh_refit_range(BVHNode *nodes, Bounds3 *leaf_bounds, u32 first, u32 end) {
+    for (u32 node_index = end;
+         node_index > first;
+         ) {
+        --node_index;
+        BVHNode *node = nodes + node_index;
+        if (node->nobj) {
+            Bounds3 bounds = bounds3empty();
+            for (u32 prim_index = node->obj_offset;
+                 prim_index < node->obj_offset + node->nobj;
+                 ++prim_index) {
+                bounds = bounds3_join(bounds, leaf_bounds[prim_index]);
+            }
+            node->bounds = bounds;
+        } else {
+            node->bounds = bounds3_join(nodes[node_index + 1].bounds, nodes[node->sec_child_offset].bounds);
+        }
+    }
+}
+
+typedef struct {
+    BVHNode *nodes;
+    Bounds3 *leaf_bounds;
+    u32 *subtree_roots;
+    u32 subtree_count;
+    // Subtrees are roots of nodes at that depth
+    u32 subtree_depth;
+} BVHRefitter;
+
+static void
+bvh_collect_subtrees(BVHRefitter *refitter, u32 node_index, u32 depth) {
+    BVHNode *node = refitter->nodes + node_index;
+    if (depth == refitter->subtree_depth || node->nobj) {
+        refitter->subtree_roots[refitter->subtree_count++] = node_index;
+    } else {
+        bvh_collect_subtrees(refitter, node_index + 1, depth + 1);
+        bvh_collect_subtrees(refitter, node->sec_child_offset, depth + 1);
+    }
+}
+
+static JOB_PROC_SIGNATURE(bvh_refit_subtree_proc) {
+    BVHRefitter *refitter = param;
+    u32 root = refitter->subtree_roots[job_index];
+    bvh_refit_range(refitter->nodes, refitter->leaf_bounds, root, bvh_subtree_end(refitter->nodes, root));
+}
+
+// Refits nodes above subtrees, which are already refitted
+static void
+bvh_refit_top(BVHRefitter *refitter, u32 node_index, u32 depth) {
+    BVHNode *node = refitter->nodes + node_index;
+    if (depth < refitter->subtree_depth && !node->nobj) {
+        bvh_refit_top(refitter, node_index + 1, depth + 1);
+        bvh_refit_top(refitter, node->sec_child_offset, depth + 1);
+        node->bounds = bounds3_join(refitter->nodes[node_index + 1].bounds, refitter->nodes[node->sec_child_offset].bounds);
+    }
+}
+
+// Wide nodes are also stored in depth-first order, so they are refitted with reverse sweep as well.
+// Compressed nodes are quantized again from refitted bounds
+static void
+bvh_refit_wide(BVH *bvh, Bounds3 *leaf_bounds) {
+    Bounds3 *node_bounds = malloc(bvh->wide_node_count * sizeof(Bounds3));
+    for (u32 node_index = bvh->wide_node_count;
+         node_index > 0;
+         ) {
+        --node_index;
+        BVHWideNode temp;
+        BVHWideNode *node = &temp;
+        if (bvh->compressed_nodes) {
+            BVHCompressedNode *compressed = bvh->compressed_nodes + node_index;
+            temp.child_count = compressed->child_count;
+            memcpy(temp.child, compressed->child, sizeof(temp.child));
+            memcpy(temp.nobj, compressed->nobj, sizeof(temp.nobj));
+        } else {
+            node = bvh->wide_nodes + node_index;
+        }
+        
+        Bounds3 total = bounds3empty();
+        for (u32 child_index = 0;
+             child_index < node->child_count;
+             ++child_index) {
+            Bounds3 bounds = bounds3empty();
+            if (node->nobj[child_index]) {
+                for (u32 prim_index = node->child[child_index];
+                     prim_index < node->child[child_index] + node->nobj[child_index];
+                     ++prim_index) {
+                    bounds = bounds3_join(bounds, leaf_bounds[prim_index]);
+                }
+            } else {
+                bounds = node_bounds[node->child[child_index]];
+            }
+            node->min_x[child_index] = bounds.min.x;
+            node->min_y[child_index] = bounds.min.y;
+            node->min_z[child_index] = bounds.min.z;
+            node->max_x[child_index] = bounds.max.x;
+            node->max_y[child_index] = bounds.max.y;
+            node->max_z[child_index] = bounds.max.z;
+            total = bounds3_join(total, bounds);
+        }
+        node_bounds[node_index] = total;
+        
+        if (bvh->compressed_nodes) {
+            bvh_compress_node(&temp, bvh->compressed_nodes + node_index);
+        }
+    }
+    free(node_bounds);
+}
+
+bool
+refit_bvh(BVH *bvh, Bounds3 *leaf_bounds, u32 thread_count) {
+    if (!bvh->node_count) {
+        return false;
+    }
+    
+    BVHRefitter refitter = {0};
+    refitter.nodes = bvh->nodes;
+    refitter.leaf_bounds = leaf_bounds;
+    if (thread_count > 1 && bvh->node_count >= 2 * BVH_MIN_TASK_SIZE) {
+        // Have more subtrees than threads so work is balanced even if subtrees are uneven
+        while ((1u << refitter.subtree_depth) < thread_count * 4) {
+            ++refitter.subtree_depth;
+        }
+        refitter.subtree_roots = malloc((1 << refitter.subtree_depth) * sizeof(u32));
+        bvh_collect_subtrees(&refitter, 0, 0);
+        run_parallel_jobs(bvh_refit_subtree_proc, &refitter, refitter.subtree_count, thread_count);
+        bvh_refit_top(&refitter, 0, 0);
+        free(refitter.subtree_roots);
+    } else {
+        bvh_refit_range(bvh->nodes, leaf_bounds, 0, bvh->node_count);
+    }
+    
+    bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+    if (bvh->wide_node_count) {
+        bvh_refit_wide(bvh, leaf_bounds);
+    }
+    
+    return bvh_sah_cost(bvh) > bvh->build_sah_cost * BVH_REFIT_REBUILD_THRESHOLD;
+}
+
+void
+bvh_make_motion(MemoryArena *arena, BVH *bvh, Bounds3 *leaf_start_bounds, Bounds3 *leaf_end_bounds) {
+    // Wide nodes don't have end bounds
+    assert(!bvh->wide_node_count);
+    bvh_refit_range(bvh->nodes, leaf_end_bounds, 0, bvh->node_count);
+    bvh->end_bounds = arena_alloc(arena, bvh->node_count * sizeof(Bounds3));
+    for (u32 node_index = 0;
+         node_index < bvh->node_count;
+         ++node_index) {
+        bvh->end_bounds[node_index] = bvh->nodes[node_index].bounds;
+    }
+    bvh_refit_range(bvh->nodes, leaf_start_bounds, 0, bvh->node_count);
+    bvh_assign_split_axes(bvh->nodes, bvh->node_count);
+}
+
+u64 
+bvh_traversal_node_memory(BVH *bvh) {
+    u64 result = 0;
+    if (bvh->compressed_nodes) {
+        result = bvh->wide_node_count * sizeof(BVHCompressedNode);
+    } else if (bvh->wide_nodes) {
+        result = bvh->wide_node_count * sizeof(BVHWideNode);
+    } else {
+        result = bvh->node_count * sizeof(BVHNode);
+        if (bvh->end_bounds) {
+            result += bvh->node_count * sizeof(Bounds3);
+        }
+    }
+    return result;
+}
+
+// Maximum number of leaves of treelet that is restructured at once
+#define BVH_TREELET_LEAF_COUNT 7
+// Treelet roots are processed by jobs in batches of that size
+#define BVH_TREELET_BATCH_SIZE 256
+
+// Node of hierarchy as seen by optimizer. 
+// Depth-first order can't be maintained while restructuring, so both children are stored
+typedef struct {
+    Bounds3 bounds;
+    // Children of interior node, child[0] is obj_offset for leaf
+    u32 child[2];
+    u16 nobj;
+    // Height of subtree at start of pass, interior nodes of same height are processed in parallel
+    u32 height;
+    // SAH cost of subtree, not normalized by root area
+    f32 cost;
+} BVHOptimizerNode;
+
+typedef struct {
+    BVHOptimizerNode *nodes;
+    // Interior nodes sorted by height
+    u32 *roots;
+    u32 first_root;
+    u32 root_count;
+} BVHOptimizer;
+
+static u32 
+bvh_optimizer_compute_heights(BVHOptimizerNode *nodes, u32 node_index) {
+    BVHOptimizerNode *node = nodes + node_index;
+    node->height = 0;
+    if (!node->nobj) {
+        u32 left = bvh_optimizer_compute_heights(nodes, node->child[0]);
+        u32 right = bvh_optimizer_compute_heights(nodes, node->child[1]);
+        node->height = (left > right ? left : right) + 1;
+    }
+    return node->height;
+}
+
+static Bounds3 
+bvh_treelet_set_bounds(BVHOptimizerNode *nodes, u32 *leaves, u32 leaf_count, u32 set) {
+    Bounds3 bounds = bounds3empty();
+    for (u32 leaf_index = 0;
+         leaf_index < leaf_count;
+         ++leaf_index) {
+        if (set & (1 << leaf_index)) {
+            bounds = bounds3_join(bounds, nodes[leaves[leaf_index]].bounds);
+        }
+    }
+    return bounds;
+}
+
+// Finds optimal topology of treelet with dynamic programming over subsets of its leaves
+// and rearranges it in place, reusing its interior nodes (Karras & Aila, 2013)
+static void
+bvh_optimize_treelet(BVHOptimizerNode *nodes, u32 root) {
+    // Subtrees below could have been restructured earlier in this pass, so root cost is brought up to date first.
+    // Stale cost would be higher than real one, and treelet would be rewritten to topology of same cost
+    BVHOptimizerNode *root_node = nodes + root;
+    root_node->cost = BVH_TRAVERSAL_COST * bound3s_surface_area(root_node->bounds) + 
+        nodes[root_node->child[0]].cost + nodes[root_node->child[1]].cost;
+    
+    u32 leaves[BVH_TREELET_LEAF_COUNT];
+    u32 interior[BVH_TREELET_LEAF_COUNT - 1];
+    u32 leaf_count = 2;
+    u32 interior_count = 1;
+    leaves[0] = nodes[root].child[0];
+    leaves[1] = nodes[root].child[1];
+    interior[0] = root;
+    // Treelet is grown by expanding leaf with largest area, as it has most potential to improve
+    while (leaf_count < BVH_TREELET_LEAF_COUNT) {
+        i32 expand_index = -1;
+        f32 expand_area = -1.0f;
+        for (u32 leaf_index = 0;
+             leaf_index < leaf_count;
+             ++leaf_index) {
+            BVHOptimizerNode *leaf = nodes + leaves[leaf_index];
+            f32 area = bound3s_surface_area(leaf->bounds);
+            if (!leaf->nobj && area > expand_area) {
+                expand_index = leaf_index;
+                expand_area = area;
+            }
+        }
+        if (expand_index < 0) {
+            break;
+        }
+        
+        BVHOptimizerNode *expanded = nodes + leaves[expand_index];
+        interior[interior_count++] = leaves[expand_index];
+        leaves[expand_index] = expanded->child[0];
+        leaves[leaf_count++] = expanded->child[1];
+    }
+    if (leaf_count < 3) {
+        return;
+    }
+    
+    // Subsets of leaves are bitmasks. Subsets of any set are numerically smaller than it, 
+    // so iterating in increasing order computes them before set itself
+    f32 area[1 << BVH_TREELET_LEAF_COUNT];
+    f32 cost[1 << BVH_TREELET_LEAF_COUNT];
+    u8 partition[1 << BVH_TREELET_LEAF_COUNT];
+    u32 full_set = (1 << leaf_count) - 1;
+    for (u32 set = 1;
+         set <= full_set;
+         ++set) {
+        area[set] = bound3s_surface_area(bvh_treelet_set_bounds(nodes, leaves, leaf_count, set));
+        
+        if (!(set & (set - 1))) {
+            u32 leaf_index = 0;
+            while (!(set & (1 << leaf_index))) {
+                ++leaf_index;
+            }
+            cost[set] = nodes[leaves[leaf_index]].cost;
+        } else {
+            // Enumerate nonempty subsets of set without its lowest leaf, so each partition is seen once
+            f32 best_cost = INFINITY;
+            u32 delta = (set - 1) & set;
+            u32 part = (0 - delta) & set;
+            while (part) {
+                f32 part_cost = cost[part] + cost[set ^ part];
+                if (part_cost < best_cost) {
+                    best_cost = part_cost;
+                    partition[set] = part;
+                }
+                part = (part - delta) & set;
+            }
+            cost[set] = BVH_TRAVERSAL_COST * area[set] + best_cost;
+        }
+    }
+    
+    // Rounding errors could make treelets flip back and forth endlessly
+    if (cost[full_set] >= nodes[root].cost * (1.0f - 1e-5f)) {
+        return;
+    }
+    
+    // Rebuild treelet top-down from partitions, reusing its interior nodes
+    u32 stack_sets[BVH_TREELET_LEAF_COUNT];
+    u32 stack_nodes[BVH_TREELET_LEAF_COUNT];
+    u32 stack_size = 0;
+    u32 next_interior = 1;
+    stack_sets[stack_size] = full_set;
+    stack_nodes[stack_size++] = root;
+    while (stack_size) {
+        --stack_size;
+        u32 set = stack_sets[stack_size];
+        BVHOptimizerNode *node = nodes + stack_nodes[stack_size];
+        node->bounds = bvh_treelet_set_bounds(nodes, leaves, leaf_count, set);
+        node->cost = cost[set];
+        u32 parts[2] = { partition[set], set ^ partition[set] };
+        for (u32 child_index = 0;
+             child_index < 2;
+             ++child_index) {
+            u32 part = parts[child_index];
+            if (!(part & (part - 1))) {
+                u32 leaf_index = 0;
+                while (!(part & (1 << leaf_index))) {
+                    ++leaf_index;
+                }
+                node->child[child_index] = leaves[leaf_index];
+            } else {
+                u32 child = interior[next_interior++];
+                node->child[child_index] = child;
+                stack_sets[stack_size] = part;
+                stack_nodes[stack_size++] = child;
+            }
+        }
+    }
+    assert(next_interior == interior_count);
+}
+
+static JOB_PROC_SIGNATURE(bvh_optimize_treelets_proc) {
+    BVHOptimizer *optimizer = param;
+    u32 first = job_index * BVH_TREELET_BATCH_SIZE;
+    u32 end = first + BVH_TREELET_BATCH_SIZE;
+    if (end > optimizer->root_count) {
+        end = optimizer->root_count;
+    }
+    for (u32 root_index = first;
+         root_index < end;
+         ++root_index) {
+        bvh_optimize_treelet(optimizer->nodes, optimizer->roots[optimizer->first_root + root_index]);
+    }
+}
+
+// Writes optimized hierarchy back in depth-first order. 
+// Returns false if it got deeper than BVH_MAX_DEPTH, so traversal stack could overflow
+static bool
+bvh_optimizer_flatten(BVHOptimizerNode *nodes, u32 node_index, BVHNode *dst, u32 *dst_count, u32 depth) {
+    if (depth >= BVH_MAX_DEPTH) {
+        return false;
+    }
+    
+    BVHOptimizerNode *node = nodes + node_index;
+    u32 dst_index = (*dst_count)++;
+    dst[dst_index].bounds = node->bounds;
+    dst[dst_index].nobj = node->nobj;
+    bool result = true;
+    if (node->nobj) {
+        dst[dst_index].obj_offset = node->child[0];
+    } else {
+        result = bvh_optimizer_flatten(nodes, node->child[0], dst, dst_count, depth + 1);
+        dst[dst_index].sec_child_offset = *dst_count;
+        result = result && bvh_optimizer_flatten(nodes, node->child[1], dst, dst_count, depth + 1);
+    }
+    return result;
+}
+
+// Improves topology of built hierarchy by restructuring small treelets to minimize their SAH cost.
+// Each pass goes bottom-up, so improvements of lower treelets are considered by upper ones.
+// Node count stays the same
+static void
+bvh_optimize(BVHNode *nodes, u32 node_count, u32 pass_count, u32 thread_count) {
+    if (node_count < 3) {
+        return;
+    }
+    
+    BVHOptimizer optimizer = {0};
+    optimizer.nodes = malloc(node_count * sizeof(BVHOptimizerNode));
+    // Nodes are in depth-first order, so children are always visited before parents in reverse order
+    for (u32 node_index = node_count;
+         node_index > 0;
+         ) {
+        --node_index;
+        BVHNode *node = nodes + node_index;
+        BVHOptimizerNode *dst = optimizer.nodes + node_index;
+        dst->bounds = node->bounds;
+        dst->nobj = node->nobj;
+        f32 area = bound3s_surface_area(node->bounds);
+        if (node->nobj) {
+            dst->child[0] = node->obj_offset;
+            dst->cost = BVH_INTERSECTION_COST * area * node->nobj;
+        } else {
+            dst->child[0] = node_index + 1;
+            dst->child[1] = node->sec_child_offset;
+            dst->cost = BVH_TRAVERSAL_COST * area + optimizer.nodes[dst->child[0]].cost + optimizer.nodes[dst->child[1]].cost;
+        }
+    }
+    
+    optimizer.roots = malloc(node_count * sizeof(u32));
+    for (u32 pass_index = 0;
+         pass_index < pass_count;
+         ++pass_index) {
+        // Sort interior nodes by height with counting sort. Nodes of same height have disjoint subtrees, 
+        // and restructuring only rearranges nodes inside subtree, so same height treelets are independent.
+        // Height of node with two leaf children is 1, and these can't be restructured
+        u32 max_height = bvh_optimizer_compute_heights(optimizer.nodes, 0);
+        u32 *height_counts = calloc(max_height + 1, sizeof(u32));
+        for (u32 node_index = 0;
+             node_index < node_count;
+             ++node_index) {
+            ++height_counts[optimizer.nodes[node_index].height];
+        }
+        u32 offset = 0;
+        for (u32 height = 0;
+             height <= max_height;
+             ++height) {
+            u32 count = height_counts[height];
+            height_counts[height] = offset;
+            offset += count;
+        }
+        for (u32 node_index = 0;
+             node_index < node_count;
+             ++node_index) {
+            optimizer.roots[height_counts[optimizer.nodes[node_index].height]++] = node_index;
+        }
+        
+        // height_counts now holds end offsets of each height
+        for (u32 height = 2;
+             height <= max_height;
+             ++height) {
+            optimizer.first_root = height_counts[height - 1];
+            optimizer.root_count = height_counts[height] - optimizer.first_root;
+            u32 job_count = (optimizer.root_count + BVH_TREELET_BATCH_SIZE - 1) / BVH_TREELET_BATCH_SIZE;
+            run_parallel_jobs(bvh_optimize_treelets_proc, &optimizer, job_count, thread_count);
+        }
+        free(height_counts);
+    }
+    free(optimizer.roots);
+    
+    BVHNode *optimized = malloc(node_count * sizeof(BVHNode));
+    u32 optimized_count = 0;
+    if (bvh_optimizer_flatten(optimizer.nodes, 0, optimized, &optimized_count, 0)) {
+        assert(optimized_count == node_count);
+        memcpy(nodes, optimized, node_count * sizeof(BVHNode));
+    }
+    free(optimized);
+    free(optimizer.nodes);
+}
+
+void
+bvh_report(BVH *bvh, BVHReport *report) {
+    memset(report, 0, sizeof(*report));
+    if (!bvh->node_count) {
+        return;
+    }
+    
+    report->sah_cost = bvh_sah_cost(bvh);
+    f32 root_area = bound3s_surface_area(bvh->nodes[0].bounds);
+    f32 inv_root_area = root_area > 0.0f ? 1.0f / root_area : 0.0f;
+    f32 interior_area = 0.0f;
+    f32 overlap_area = 0.0f;
+    // Children are always after parent in depth-first order, so their depth is known when they are reached
+    u32 *depths = malloc(bvh->node_count * sizeof(u32));
+    depths[0] = 0;
+    for (u32 node_index = 0;
+         node_index < bvh->node_count;
+         ++node_index) {
+        BVHNode *node = bvh->nodes + node_index;
+        u32 depth = depths[node_index];
+        if (depth >= BVH_MAX_DEPTH) {
+            depth = BVH_MAX_DEPTH - 1;
+        }
+        if (depth + 1 > report->level_count) {
+            report->level_count = depth + 1;
+        }
+        
+        BVHLevelReport *level = report->levels + depth;
+        f32 area = bound3s_surface_area(node->bounds);
+        ++level->node_count;
+        level->area += area * inv_root_area;
+        if (node->nobj) {
+            ++level->leaf_count;
+            level->prim_count += node->nobj;
+            ++report->leaf_count;
+            ++report->leaf_size_histogram[node->nobj < BVH_REPORT_MAX_LEAF_SIZE ? node->nobj : BVH_REPORT_MAX_LEAF_SIZE];
+        } else {
+            depths[node_index + 1] = depths[node_index] + 1;
+            depths[node->sec_child_offset] = depths[node_index] + 1;
+            
+            Bounds3 a = bvh->nodes[node_index + 1].bounds;
+            Bounds3 b = bvh->nodes[node->sec_child_offset].bounds;
+            Bounds3 overlap;
+            overlap.min = v3(max32(a.min.x, b.min.x), max32(a.min.y, b.min.y), max32(a.min.z, b.min.z));
+            overlap.max = v3(min32(a.max.x, b.max.x), min32(a.max.y, b.max.y), min32(a.max.z, b.max.z));
+            if (overlap.min.x <= overlap.max.x && overlap.min.y <= overlap.max.y && overlap.min.z <= overlap.max.z) {
+                f32 overlap_surface_area = bound3s_surface_area(overlap);
+                level->overlap_area += overlap_surface_area * inv_root_area;
+                overlap_area += overlap_surface_area;
+            }
+            interior_area += area;
+        }
+    }
+    free(depths);
+    
+    if (interior_area > 0.0f) {
+        report->overlap_ratio = overlap_area / interior_area;
+    }
+}
+
+// Builds postponed subtrees in parallel and stitches them together with top-level nodes into buffer
+static void
+bvh_finish_tasks(BVHBuilder *builder, BVHBuildBuffer *top, BVHBuildBuffer *buffer, u32 thread_count) {
+    if (builder->task_count) {
+        run_parallel_jobs(bvh_build_task_proc, builder, builder->task_count, thread_count);
+        u32 next_task_index = 0;
+        bvh_stitch_tasks(buffer, top, 0, builder, &next_task_index);
+        assert(next_task_index == builder->task_count);
+        free(top->nodes);
+        free(top->prims);
+    } else {
+        *buffer = *top;
+    }
+    free(builder->tasks);
+}
+
+// Sorts primitives by Morton codes of their centroids. Returns sorted codes, that need to be freed
+static u64 *
+bvh_sort_morton(BVHPrimitive *prims, u32 prim_count, u32 thread_count, u32 *code_bits_out) {
+    Bounds3 centroid_bounds = bounds3empty();
+    for (u32 prim_index = 0;
+         prim_index < prim_count;
+         ++prim_index) {
+        centroid_bounds = bounds3_extend(centroid_bounds, prims[prim_index].centroid);
+    }
+    
+    u32 bits_per_axis = prim_count <= BVH_MORTON30_MAX_PRIMS ? 10 : 21;
+    u64 *codes = malloc(sizeof(u64) * prim_count);
+    u32 *order = malloc(sizeof(u32) * prim_count);
+    for (u32 prim_index = 0;
+         prim_index < prim_count;
+         ++prim_index) {
+        codes[prim_index] = bvh_morton_code(prims[prim_index].centroid, centroid_bounds, bits_per_axis);
+        order[prim_index] = prim_index;
+    }
+    bvh_radix_sort(codes, order, prim_count, bits_per_axis * 3, thread_count);
+    
+    BVHPrimitive *sorted = malloc(sizeof(BVHPrimitive) * prim_count);
+    for (u32 prim_index = 0;
+         prim_index < prim_count;
+         ++prim_index) {
+        sorted[prim_index] = prims[order[prim_index]];
+    }
+    memcpy(prims, sorted, sizeof(BVHPrimitive) * prim_count);
+    free(sorted);
+    free(order);
+    
+    if (code_bits_out) {
+        *code_bits_out = bits_per_axis * 3;
+    }
+    return codes;
+}
+
+BVH
+build_bvh(MemoryArena *arena, BVHPrimitive *prims, u32 prim_count, BVHBuildSettings settings) {
+    BVH bvh = {0};
+    if (!prim_count) {
+        return bvh;
+    }
+    
+    f64 start_time = get_wall_clock_ms();
+    for (u32 prim_index = 0;
+         prim_index < prim_count;
+         ++prim_index) {
+        prims[prim_index].centroid = bounds3_center(prims[prim_index].bounds);
+    }
+    
+    BVHBuildBuffer buffer = {0};
+    switch (settings.method) {
+        case BVHBuildMethod_SAHSweep: {
+            f32 *right_area = malloc(prim_count * sizeof(f32));
+            bvh_build_sweep(&buffer, prims, prim_count, right_area, 0);
+            free(right_area);
+        } break;
+        case BVHBuildMethod_BinnedSAH: {
+            BVHBuilder builder = {0};
+            builder.method = settings.method;
+            builder.max_leaf_size = BVH_MAX_LEAF_SIZE;
+            if (settings.thread_count > 1 && prim_count >= 2 * BVH_MIN_TASK_SIZE) {
+                // Have more tasks than threads so work is balanced even if subtrees are uneven
+                builder.task_size = prim_count / (settings.thread_count * 4);
+                if (builder.task_size < BVH_MIN_TASK_SIZE) {
+                    builder.task_size = BVH_MIN_TASK_SIZE;
+                }
+            }
+            
+            BVHBuildBuffer top = {0};
+            bvh_build_binned(&builder, &top, prims, prim_count, 0);
+            bvh_finish_tasks(&builder, &top, &buffer, settings.thread_count);
+        } break;
+        case BVHBuildMethod_Morton: {
+            BVHBuilder builder = {0};
+            builder.method = settings.method;
+            builder.max_leaf_size = BVH_MAX_LEAF_SIZE;
+            builder.prims = prims;
+            builder.codes = bvh_sort_morton(prims, prim_count, settings.thread_count, 0);
+            if (settings.thread_count > 1 && prim_count >= 2 * BVH_MIN_TASK_SIZE) {
+                builder.task_size = prim_count / (settings.thread_count * 4);
+                if (builder.task_size < BVH_MIN_TASK_SIZE) {
+                    builder.task_size = BVH_MIN_TASK_SIZE;
+                }
+            }
+            
+            BVHBuildBuffer top = {0};
+            bvh_build_morton(&builder, &top, prims, prim_count, 0);
+            bvh_finish_tasks(&builder, &top, &buffer, settings.thread_count);
+            free(builder.codes);
+        } break;
+        case BVHBuildMethod_MortonSAH: {
+            BVHBuilder builder = {0};
+            builder.method = settings.method;
+            builder.max_leaf_size = BVH_MAX_LEAF_SIZE;
+            builder.prims = prims;
+            u32 code_bits;
+            builder.codes = bvh_sort_morton(prims, prim_count, settings.thread_count, &code_bits);
+            
+            // Primitives with same highest code bits are in same cluster
+            u32 cluster_shift = code_bits - BVH_MORTON_CLUSTER_BITS;
+            u32 cluster_count = 0;
+            u32 *cluster_first = malloc(sizeof(u32) * prim_count);
+            BVHPrimitive *clusters = malloc(sizeof(BVHPrimitive) * prim_count);
+            for (u32 prim_index = 0;
+                 prim_index < prim_count;
+                 ++prim_index) {
+                if (!prim_index || (builder.codes[prim_index] >> cluster_shift) != (builder.codes[prim_index - 1] >> cluster_shift)) {
+                    cluster_first[cluster_count] = prim_index;
+                    clusters[cluster_count].bounds = bounds3empty();
+                    clusters[cluster_count].index = cluster_count;
+                    ++cluster_count;
+                }
+                BVHPrimitive *cluster = clusters + cluster_count - 1;
+                cluster->bounds = bounds3_join(cluster->bounds, prims[prim_index].bounds);
+            }
+            for (u32 cluster_index = 0;
+                 cluster_index < cluster_count;
+                 ++cluster_index) {
+                clusters[cluster_index].centroid = bounds3_center(clusters[cluster_index].bounds);
+            }
+            
+            // Top-level hierarchy over clusters, each leaf references single cluster
+            BVHBuilder top_builder = {0};
+            top_builder.max_leaf_size = 1;
+            BVHBuildBuffer top = {0};
+            bvh_build_binned(&top_builder, &top, clusters, cluster_count, 0);
+            
+            // Clusters are built as tasks in place of top-level leaves, in depth-first order as stitching expects
+            u32 *depths = malloc(sizeof(u32) * top.node_count);
+            depths[0] = 0;
+            for (u32 node_index = 0;
+                 node_index < top.node_count;
+                 ++node_index) {
+                BVHNode *node = top.nodes + node_index;
+                if (node->nobj) {
+                    assert(node->nobj == 1);
+                    u32 cluster_index = top.prims[node->obj_offset];
+                    u32 first = cluster_first[cluster_index];
+                    u32 end = cluster_index + 1 < cluster_count ? cluster_first[cluster_index + 1] : prim_count;
+                    bvh_push_task(&builder, node_index, prims + first, end - first, depths[node_index]);
+                } else {
+                    depths[node_index + 1] = depths[node_index] + 1;
+                    depths[node->sec_child_offset] = depths[node_index] + 1;
+                }
+            }
+            free(depths);
+            free(clusters);
+            free(cluster_first);
+            
+            bvh_finish_tasks(&builder, &top, &buffer, settings.thread_count);
+            free(builder.codes);
+        } break;
+        case BVHBuildMethod_SpatialSplit: {
+            BVHSpatialBuilder builder = {0};
+            builder.clip = settings.clip;
+            builder.clip_data = settings.clip_data;
+            builder.ref_count = prim_count;
+            builder.max_ref_count = (u32)(prim_count * max32(settings.spatial_split_budget, 1.0f));
+            Bounds3 bounds = bounds3empty();
+            for (u32 prim_index = 0;
+                 prim_index < prim_count;
+                 ++prim_index) {
+                bounds = bounds3_join(bounds, prims[prim_index].bounds);
+            }
+            builder.root_area = bound3s_surface_area(bounds);
+            bvh_build_spatial(&builder, &buffer, prims, prim_count, 0);
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+
+    if (settings.optimize_pass_count) {
+        f64 optimize_start_time = get_wall_clock_ms();
+        bvh.nodes = buffer.nodes;
+        bvh.node_count = buffer.node_count;
+        bvh.unoptimized_sah_cost = bvh_sah_cost(&bvh);
+        bvh_optimize(buffer.nodes, buffer.node_count, settings.optimize_pass_count, settings.thread_count);
+        bvh.optimize_time_ms = get_wall_clock_ms() - optimize_start_time;
+    }
+    
+    bvh_assign_split_axes(buffer.nodes, buffer.node_count);
+    
+    bvh.node_count = buffer.node_count;
+    bvh.nodes = arena_copy(arena, buffer.nodes, buffer.node_count * sizeof(BVHNode));
+    bvh.prim_count = buffer.prim_count;
+    bvh.prims = arena_copy(arena, buffer.prims, buffer.prim_count * sizeof(u32));
+    free(buffer.nodes);
+    free(buffer.prims);
+    
+    if (settings.layout == BVHLayout_Wide8 || settings.layout == BVHLayout_Compressed8) {
+        // Every wide node consumes at least one binary interior node, except for leaf root
+        BVHWideNode *wide_nodes = malloc(bvh.node_count * sizeof(BVHWideNode));
+        bvh.wide_node_count = bvh_collapse(bvh.nodes, 0, wide_nodes, 0);
+        assert(bvh.wide_node_count <= bvh.node_count);
+        if (settings.layout == BVHLayout_Wide8) {
+            bvh.wide_nodes = arena_copy(arena, wide_nodes, bvh.wide_node_count * sizeof(BVHWideNode));
+        } else {
+            bvh.compressed_nodes = arena_alloc(arena, bvh.wide_node_count * sizeof(BVHCompressedNode));
+            for (u32 node_index = 0;
+                 node_index < bvh.wide_node_count;
+                 ++node_index) {
+                bvh_compress_node(wide_nodes + node_index, bvh.compressed_nodes + node_index);
+            }
+        }
+        free(wide_nodes);
+    }
+    bvh.build_sah_cost = bvh_sah_cost(&bvh);
+    bvh.build_time_ms = get_wall_clock_ms() - start_time;
+    return bvh;
+}
+
+#define BVH_CACHE_MAGIC 0x43485642 // BVHC
+#define BVH_CACHE_VERSION 3
+// Arrays in cache file start at this alignment
+#define BVH_CACHE_ALIGNMENT 64
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 layout;
+    u32 node_count;
+    u32 prim_count;
+    u32 wide_node_count;
+    f32 build_sah_cost;
+} BVHCacheHeader;
+
+u64 
+bvh_hash(u64 hash, void *data, u64 size) {
+    u8 *bytes = data;
+    for (u64 byte_index = 0;
+         byte_index < size;
+         ++byte_index) {
+        hash ^= bytes[byte_index];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static u64 
+bvh_cache_key(BVHBuildSettings settings, u64 content_hash) {
+    // Only settings that affect result are hashed, thread count and pointers don't
+    u64 key = bvh_hash(BVH_HASH_SEED, &content_hash, sizeof(content_hash));
+    key = bvh_hash(key, &settings.method, sizeof(settings.method));
+    key = bvh_hash(key, &settings.layout, sizeof(settings.layout));
+    if (settings.method == BVHBuildMethod_SpatialSplit) {
+        key = bvh_hash(key, &settings.spatial_split_budget, sizeof(settings.spatial_split_budget));
+    }
+    if (settings.optimize_pass_count) {
+        key = bvh_hash(key, &settings.optimize_pass_count, sizeof(settings.optimize_pass_count));
+    }
+    return key;
+}
+
+static u64 
+bvh_cache_align(u64 offset) {
+    return (offset + BVH_CACHE_ALIGNMENT - 1) & ~(u64)(BVH_CACHE_ALIGNMENT - 1);
+}
+
+// Offsets of arrays in cache file. Returns total file size
+static u64 
+bvh_cache_layout(BVHCacheHeader *header, u64 *nodes_offset, u64 *prims_offset, u64 *wide_nodes_offset) {
+    u64 wide_node_size = header->layout == BVHLayout_Compressed8 ? sizeof(BVHCompressedNode) : sizeof(BVHWideNode);
+    *nodes_offset = bvh_cache_align(sizeof(BVHCacheHeader));
+    *prims_offset = bvh_cache_align(*nodes_offset + (u64)header->node_count * sizeof(BVHNode));
+    *wide_nodes_offset = bvh_cache_align(*prims_offset + (u64)header->prim_count * sizeof(u32));
+    return *wide_nodes_offset + (u64)header->wide_node_count * wide_node_size;
+}
+
+// Builder can go few levels past BVH_MAX_DEPTH with median splits, deeper cached trees could overflow traversal stacks
+#define BVH_CACHE_MAX_DEPTH (BVH_MAX_DEPTH + BVH_MAX_DEPTH / 4)
+
+// Child links of wide node, same for both wide layouts
+static bool
+bvh_cache_wide_node_is_valid(u32 node_index, u32 child_count, u32 *children, u16 *nobjs, BVH *bvh, u8 *depths) {
+    if (child_count > BVH_WIDE_WIDTH) {
+        return false;
+    }
+    for (u32 child_index = 0;
+         child_index < child_count;
+         ++child_index) {
+        u32 child = children[child_index];
+        if (nobjs[child_index]) {
+            if ((u64)child + nobjs[child_index] > bvh->prim_count) {
+                return false;
+            }
+        } else {
+            if (child <= node_index || child >= bvh->wide_node_count) {
+                return false;
+            }
+            depths[child] = depths[node_index] + 1;
+        }
+    }
+    return true;
+}
+
+// Checks that all indices in hierarchy are inside its arrays and traversal stacks can't overflow, 
+// so broken or stale cache file can't make traversal read out of bounds.
+// Children are always stored after their parents, so depths are found in single pass
+static bool
+bvh_cache_is_valid(BVH *bvh, u32 prim_count) {
+    bool result = bvh->node_count != 0;
+    for (u32 prim_index = 0;
+         prim_index < bvh->prim_count && result;
+         ++prim_index) {
+        result = bvh->prims[prim_index] < prim_count;
+    }
+    
+    u32 max_depth_count = bvh->node_count > bvh->wide_node_count ? bvh->node_count : bvh->wide_node_count;
+    u8 *depths = calloc(max_depth_count, sizeof(u8));
+    for (u32 node_index = 0;
+         node_index < bvh->node_count && result;
+         ++node_index) {
+        BVHNode *node = bvh->nodes + node_index;
+        if (node->nobj) {
+            result = (u64)node->obj_offset + node->nobj <= bvh->prim_count;
+        } else {
+            result = node->sec_child_offset > node_index + 1 && node->sec_child_offset < bvh->node_count &&
+                depths[node_index] < BVH_CACHE_MAX_DEPTH;
+            if (result) {
+                depths[node_index + 1] = depths[node->sec_child_offset] = depths[node_index] + 1;
+            }
+        }
+    }
+    
+    memset(depths, 0, max_depth_count * sizeof(u8));
+    for (u32 node_index = 0;
+         node_index < bvh->wide_node_count && result;
+         ++node_index) {
+        // Every level of wide traversal can leave all but one child on stack
+        result = (depths[node_index] + 1) * (BVH_WIDE_WIDTH - 1) < BVH_WIDE_STACK_SIZE;
+        if (result && bvh->compressed_nodes) {
+            BVHCompressedNode *node = bvh->compressed_nodes + node_index;
+            result = bvh_cache_wide_node_is_valid(node_index, node->child_count, node->child, node->nobj, bvh, depths);
+        } else if (result) {
+            BVHWideNode *node = bvh->wide_nodes + node_index;
+            result = bvh_cache_wide_node_is_valid(node_index, node->child_count, node->child, node->nobj, bvh, depths);
+        }
+    }
+    free(depths);
+    
+    return result;
+}
+
+// prim_count is number of primitives hierarchy is built for. 
+// Only spatial split hierarchies can reference more primitives than that
+static bool
+bvh_load_cache(char *filename, u64 key, BVHLayout layout, u32 prim_count, bool has_duplicates, BVH *bvh) {
+    u64 size = 0;
+    u8 *file = map_file(filename, &size);
+    if (!file) {
+        return false;
+    }
+    
+    // @NOTE Mapping of loaded hierarchy is never released, cached hierarchies live as long as world does
+    BVHCacheHeader *header = (BVHCacheHeader *)file;
+    u64 nodes_offset, prims_offset, wide_nodes_offset;
+    if (size < sizeof(BVHCacheHeader) || header->magic != BVH_CACHE_MAGIC || header->version != BVH_CACHE_VERSION ||
+        header->key != key || header->layout != layout ||
+        (has_duplicates ? header->prim_count < prim_count : header->prim_count != prim_count) ||
+        (layout != BVHLayout_Binary) != (header->wide_node_count != 0) ||
+        bvh_cache_layout(header, &nodes_offset, &prims_offset, &wide_nodes_offset) != size) {
+        fprintf(stderr, "[WARNING] Ignoring invalid BVH cache file %s\n", filename);
+        unmap_file(file, size);
+        return false;
+    }
+    
+    memset(bvh, 0, sizeof(*bvh));
+    bvh->nodes = (BVHNode *)(file + nodes_offset);
+    bvh->node_count = header->node_count;
+    bvh->prims = (u32 *)(file + prims_offset);
+    bvh->prim_count = header->prim_count;
+    bvh->wide_node_count = header->wide_node_count;
+    if (layout == BVHLayout_Wide8) {
+        bvh->wide_nodes = (BVHWideNode *)(file + wide_nodes_offset);
+    } else if (layout == BVHLayout_Compressed8) {
+        bvh->compressed_nodes = (BVHCompressedNode *)(file + wide_nodes_offset);
+    }
+    bvh->build_sah_cost = header->build_sah_cost;
+    bvh->is_cached = true;
+    
+    if (!bvh_cache_is_valid(bvh, prim_count)) {
+        fprintf(stderr, "[WARNING] Ignoring BVH cache file %s with out of range indices\n", filename);
+        memset(bvh, 0, sizeof(*bvh));
+        unmap_file(file, size);
+        return false;
+    }
+    return true;
+}
+
+static void
+bvh_save_cache(char *filename, u64 key, BVHLayout layout, BVH *bvh) {
+    BVHCacheHeader header = {0};
+    header.magic = BVH_CACHE_MAGIC;
+    header.version = BVH_CACHE_VERSION;
+    header.key = key;
+    header.layout = layout;
+    header.node_count = bvh->node_count;
+    header.prim_count = bvh->prim_count;
+    header.wide_node_count = bvh->wide_node_count;
+    header.build_sah_cost = bvh->build_sah_cost;
+    u64 nodes_offset, prims_offset, wide_nodes_offset;
+    u64 size = bvh_cache_layout(&header, &nodes_offset, &prims_offset, &wide_nodes_offset);
+    
+    u8 *file = calloc(1, size);
+    memcpy(file, &header, sizeof(header));
+    memcpy(file + nodes_offset, bvh->nodes, (u64)bvh->node_count * sizeof(BVHNode));
+    memcpy(file + prims_offset, bvh->prims, (u64)bvh->prim_count * sizeof(u32));
+    if (bvh->wide_nodes) {
+        memcpy(file + wide_nodes_offset, bvh->wide_nodes, (u64)bvh->wide_node_count * sizeof(BVHWideNode));
+    } else if (bvh->compressed_nodes) {
+        memcpy(file + wide_nodes_offset, bvh->compressed_nodes, (u64)bvh->wide_node_count * sizeof(BVHCompressedNode));
+    }
+    
+    FILE *out = fopen(filename, "wb");
+    if (out) {
+        fwrite(file, 1, size, out);
+        fclose(out);
+    } else {
+        fprintf(stderr, "[WARNING] Failed to write BVH cache file %s\n", filename);
+    }
+    free(file);
+}
+
+BVH
+build_bvh_cached(MemoryArena *arena, BVHPrimitive *prims, u32 prim_count, BVHBuildSettings settings, u64 content_hash) {
+    if (!settings.cache_directory || !prim_count) {
+        return build_bvh(arena, prims, prim_count, settings);
+    }
+    
+    u64 key = bvh_cache_key(settings, content_hash);
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/%016llx.bvh", settings.cache_directory, (unsigned long long)key);
+    
+    BVH bvh;
+    f64 start_time = get_wall_clock_ms();
+    if (bvh_load_cache(filename, key, settings.layout, prim_count, settings.method == BVHBuildMethod_SpatialSplit, &bvh)) {
+        bvh.build_time_ms = get_wall_clock_ms() - start_time;
+    } else {
+        bvh = build_bvh(arena, prims, prim_count, settings);
+        bvh_save_cache(filename, key, settings.layout, &bvh);
+    }
+    return bvh;
+}
@@ -0,0 +1,219 @@
+#if !defined(BVH_H)
+
+#include "general.h"
+#include "ray_math.h"
+#include "memory_arena.h"
+
+// Maximum depth of hierarchy. Builder falls back to median splits when it gets close to it,
+// so traversal can use fixed-size stack
+#define BVH_MAX_DEPTH 64
+#define BVH_STACK_SIZE (2 * BVH_MAX_DEPTH)
+// Number of children of wide hierarchy node
+#define BVH_WIDE_WIDTH 8
+#define BVH_WIDE_STACK_SIZE (BVH_WIDE_WIDTH * BVH_MAX_DEPTH)
+// Refitted hierarchy is considered degraded when its SAH cost grows that many times compared to built one
+#define BVH_REFIT_REBUILD_THRESHOLD 1.5f
+
+#define BVH_SPLIT_AXIS_MASK 0x3
+#define BVH_SPLIT_AXIS_FLIPPED 0x4
+
+// Node of flattened hierarchy.
+// Nodes are stored in depth-first order, so first child of interior node is always located
+// right after its parent and only offset of second child needs to be stored
+typedef struct {
+    Bounds3 bounds;
+    union {
+        u32 obj_offset;       // leaf
+        u32 sec_child_offset; // interior
+    };
+    // If not 0, node is leaf and references nobj primitives starting from obj_offset
+    u16 nobj;
+    // Axis along which children of interior node are separated, so traversal can visit nearer one first.
+    // First child is on lower side of axis, unless BVH_SPLIT_AXIS_FLIPPED bit is set
+    u8 split_axis;
+} BVHNode;
+
+// Node of wide hierarchy, made by collapsing binary one.
+// Child bounds are stored in SoA form so all children can be tested against ray at once.
+// Slots past child_count are unused
+typedef struct {
+    f32 min_x[BVH_WIDE_WIDTH];
+    f32 min_y[BVH_WIDE_WIDTH];
+    f32 min_z[BVH_WIDE_WIDTH];
+    f32 max_x[BVH_WIDE_WIDTH];
+    f32 max_y[BVH_WIDE_WIDTH];
+    f32 max_z[BVH_WIDE_WIDTH];
+    // Index of child node for interior children, offset of first primitive for leaves
+    u32 child[BVH_WIDE_WIDTH];
+    // If not 0, child is leaf and references nobj primitives
+    u16 nobj[BVH_WIDE_WIDTH];
+    u32 child_count;
+} BVHWideNode;
+
+// Wide node with child bounds quantized to 8 bits relative to node bounds.
+// Quantization step is power of two, so decoding is exact and bounds are rounded outwards
+typedef struct {
+    // Minimum corner of node bounds
+    Vec3 origin;
+    // Quantization step along each axis is 2^exponent
+    i8 exponent[3];
+    u8 child_count;
+    u8 q_min_x[BVH_WIDE_WIDTH];
+    u8 q_min_y[BVH_WIDE_WIDTH];
+    u8 q_min_z[BVH_WIDE_WIDTH];
+    u8 q_max_x[BVH_WIDE_WIDTH];
+    u8 q_max_y[BVH_WIDE_WIDTH];
+    u8 q_max_z[BVH_WIDE_WIDTH];
+    u32 child[BVH_WIDE_WIDTH];
+    u16 nobj[BVH_WIDE_WIDTH];
+} BVHCompressedNode;
+
+// Primitive as seen by builder.
+// Builder does not know anything about actual geometry, only about its bounds
+typedef struct {
+    Bounds3 bounds;
+    // Filled by builder
+    Vec3 centroid;
+    u32 index;
+} BVHPrimitive;
+
+typedef enum {
+    // Primitives are sorted along longest axis and SAH is evaluated for every split position
+    BVHBuildMethod_SAHSweep = 0x0,
+    // SAH is evaluated on bins of primitive centroids on all axes, subtrees are built in parallel
+    BVHBuildMethod_BinnedSAH,
+    // Same as BVHBuildMethod_BinnedSAH, but primitives can also be split with plane and referenced 
+    // from both sides of it when it reduces overlap of children (SBVH)
+    BVHBuildMethod_SpatialSplit,
+    // Primitives are sorted by Morton codes of centroids and split on highest differing bit (LBVH).
+    // Fastest to build, but hierarchy quality is worse than with SAH
+    BVHBuildMethod_Morton,
+    // Morton code clusters are built same as BVHBuildMethod_Morton, 
+    // and binned SAH hierarchy is built on top of them (HLBVH)
+    BVHBuildMethod_MortonSAH,
+    
+    BVHBuildMethod_Count
+} BVHBuildMethod;
+
+typedef enum {
+    // Binary nodes are traversed
+    BVHLayout_Binary = 0x0,
+    // Binary hierarchy is collapsed into BVH_WIDE_WIDTH-wide one
+    BVHLayout_Wide8,
+    // Same as BVHLayout_Wide8, but child bounds are quantized
+    BVHLayout_Compressed8,
+    
+    BVHLayout_Count
+} BVHLayout;
+
+// Computes bounds of parts of primitive on both sides of plane, perpendicular to axis.
+// Used by spatial split builder for tighter bounds than splitting primitive bounds
+#define BVH_CLIP_PROC_SIGNATURE(_name) \
+void _name(void *data, u32 index, u32 axis, f32 position, Bounds3 *left, Bounds3 *right)
+typedef BVH_CLIP_PROC_SIGNATURE(BVHClipProc);
+
+typedef struct {
+    BVHBuildMethod method;
+    BVHLayout layout;
+    // Maximum number of primitive references relative to primitive count in spatial split build
+    f32 spatial_split_budget;
+    // Optional, if not set primitive bounds are split
+    BVHClipProc *clip;
+    void *clip_data;
+    // Number of treelet restructuring passes done after build, 0 disables optimization
+    u32 optimize_pass_count;
+    // Directory where built hierarchies are cached. If 0, cache is not used
+    char *cache_directory;
+    // Number of threads used to build subtrees in parallel
+    u32 thread_count;
+    // Print build statistics of every hierarchy
+    bool report;
+} BVHBuildSettings;
+
+typedef struct {
+    BVHNode *nodes;
+    u32 node_count;
+    // Indices of primitives in order they are referenced by leaves.
+    // Spatial split build can reference same primitive multiple times
+    u32 *prims;
+    u32 prim_count;
+    // Present if built with BVHLayout_Wide8 or BVHLayout_Compressed8 respectively, 
+    // wide_node_count is count of either of them. Binary nodes are still kept for bounds queries
+    BVHWideNode *wide_nodes;
+    BVHCompressedNode *compressed_nodes;
+    u32 wide_node_count;
+    
+    // Present in motion hierarchy. Node bounds are bounds at start of its time range, 
+    // and these are at end of it. Bounds in between are interpolated linearly
+    Bounds3 *end_bounds;
+    
+    // SAH cost of hierarchy right after build, used to detect degradation after refits
+    f32 build_sah_cost;
+    f64 build_time_ms;
+    // SAH cost of hierarchy before treelet optimization and time it took, set if it was done. 
+    // build_time_ms includes optimization time
+    f32 unoptimized_sah_cost;
+    f64 optimize_time_ms;
+    // Hierarchy was loaded from cache file, arrays point to file mapping instead of arena
+    bool is_cached;
+} BVH;
+
+// Builds hierarchy over given primitives. prims array is reordered during build.
+// Resulting arrays are allocated in arena
+BVH build_bvh(MemoryArena *arena, BVHPrimitive *prims, u32 prim_count, BVHBuildSettings settings);
+
+char *bvh_build_method_to_string(BVHBuildMethod method);
+bool bvh_build_method_from_string(char *string, BVHBuildMethod *method);
+
+#define BVH_HASH_SEED 0xCBF29CE484222325ull
+// FNV-1a hash, can be chained by passing previous result as hash
+u64 bvh_hash(u64 hash, void *data, u64 size);
+// Same as build_bvh, but hierarchy is loaded from settings.cache_directory if it has been built before,
+// and saved there otherwise. content_hash must identify everything build result depends on besides settings,
+// like geometry data
+BVH build_bvh_cached(MemoryArena *arena, BVHPrimitive *prims, u32 prim_count, BVHBuildSettings settings, u64 content_hash);
+
+// Recomputes bounds of all nodes keeping topology, after primitives have moved.
+// leaf_bounds contains bounds of primitives in order they are referenced by leaves (same as bvh->prims).
+// Returns true if quality has degraded past BVH_REFIT_REBUILD_THRESHOLD and hierarchy should be rebuilt
+bool refit_bvh(BVH *bvh, Bounds3 *leaf_bounds, u32 thread_count);
+// Makes motion hierarchy out of binary one: node bounds are fit to leaf_start_bounds and end_bounds to leaf_end_bounds,
+// both in order primitives are referenced by leaves
+void bvh_make_motion(MemoryArena *arena, BVH *bvh, Bounds3 *leaf_start_bounds, Bounds3 *leaf_end_bounds);
+// Expected cost of ray traversal estimated with surface area heuristic
+f32 bvh_sah_cost(BVH *bvh);
+// Size of nodes used in traversal
+u64 bvh_traversal_node_memory(BVH *bvh);
+
+// Statistics of nodes at same depth
+typedef struct {
+    u32 node_count;
+    u32 leaf_count;
+    u32 prim_count;
+    // Total surface area of nodes and of overlap of children of interior nodes, relative to root surface area
+    f32 area;
+    f32 overlap_area;
+} BVHLevelReport;
+
+// Leaves with more primitives are counted in last bin of leaf size histogram
+#define BVH_REPORT_MAX_LEAF_SIZE 16
+
+// Quality and structure of hierarchy, computed from binary nodes
+typedef struct {
+    u32 leaf_count;
+    u32 level_count;
+    // Number of leaves by primitive count
+    u32 leaf_size_histogram[BVH_REPORT_MAX_LEAF_SIZE + 1];
+    f32 sah_cost;
+    // Surface area of overlap of children relative to surface area of their parents, over all interior nodes
+    f32 overlap_ratio;
+    BVHLevelReport levels[BVH_MAX_DEPTH];
+} BVHReport;
+
+void bvh_report(BVH *bvh, BVHReport *report);
+
+char *bvh_layout_to_string(BVHLayout layout);
+bool bvh_layout_from_string(char *string, BVHLayout *layout);
+
+#define BVH_H 1
+#endif
@@ -2,65 +2,188 @@
 #include "ray_thread.h"
 
 #include "ray_thread.c"
+#include "bvh.c"
 #include "trace.c"
+#include "wavefront.c"
 #include "world.c"
 #include "scenes.c"
 
 RandomSeries rng = { 546674573 };
 
-bool 
-render_tile(RenderWorkQueue *queue) {
-    u64 work_order_index = atomic_add64(&queue->next_order_index, 1);
-    if (work_order_index >= queue->order_count) {
-        return false;
+static void 
+write_pixel_color(u32 *pixel, Vec3 pixel_color) {
+    f32 r = linear1_to_srgb1(saturate(pixel_color.r));
+    f32 g = linear1_to_srgb1(saturate(pixel_color.g));
+    f32 b = linear1_to_srgb1(saturate(pixel_color.b));
+    *pixel = rgba_pack_4x8_linear1(b, g, r, 1.0f);     
+}
+
+// Tile is split in blocks of packet_size pixels. For each sample, camera rays of block are traced as one packet
+// to first hit, then every ray continues on its own, because bounced rays are no longer coherent
+static void 
+render_tile_packets(RenderWorkQueue *queue, RenderWorkOrder *order, RayCastData data, BVHEntryNodes *entry) {
+    u32 packet_w = queue->packet_size >= 8 ? 4 : 2;
+    u32 packet_h = queue->packet_size / packet_w;
+    f32 color_multiplier = 1.0f / (f32)queue->samples_per_pixel;
+    for (u32 block_y = order->y_min;
+         block_y < order->y_max;
+         block_y += packet_h) {
+        u32 block_h = order->y_max - block_y < packet_h ? order->y_max - block_y : packet_h;
+        for (u32 block_x = order->x_min;
+             block_x < order->x_max;
+             block_x += packet_w) {
+            u32 block_w = order->x_max - block_x < packet_w ? order->x_max - block_x : packet_w;
+            u32 ray_count = block_w * block_h;
+            
+            Vec3 pixel_colors[RAY_PACKET_MAX_SIZE] = {0};
+            for (u32 sample_index = 0;
+                 sample_index < queue->samples_per_pixel;
+                 ++sample_index) {
+                Ray rays[RAY_PACKET_MAX_SIZE];
+                for (u32 ray_index = 0;
+                     ray_index < ray_count;
+                     ++ray_index) {
+                    u32 x = block_x + ray_index % block_w;
+                    u32 y = block_y + ray_index / block_w;
+                    f32 u = ((f32)x + randomu(&order->entropy)) / (f32)queue->output->w;
+                    f32 v = ((f32)y + randomu(&order->entropy)) / (f32)queue->output->h;
+                    rays[ray_index] = camera_make_ray(&queue->world->camera, &order->entropy, u, v);
+                }
+                
+                bool has_hit[RAY_PACKET_MAX_SIZE] = {0};
+                HitRecord hrecs[RAY_PACKET_MAX_SIZE] = {0};
+                if (queue->max_bounce_count) {
+                    ray_packet_hit(queue->world, ray_count, rays, has_hit, hrecs, data, entry);
+                }
+                for (u32 ray_index = 0;
+                     ray_index < ray_count;
+                     ++ray_index) {
+                    Vec3 sample_color = ray_cast_from_hit(queue->world, rays[ray_index], has_hit[ray_index], hrecs[ray_index], 
+                                                          queue->max_bounce_count, data);
+                    sample_color = sample_color_remove_nans(sample_color);
+                    pixel_colors[ray_index] = v3add(pixel_colors[ray_index], v3muls(sample_color, color_multiplier));
+                }
+            }
+            
+            for (u32 ray_index = 0;
+                 ray_index < ray_count;
+                 ++ray_index) {
+                u32 *pixel = image_get_pixel_pointer(queue->output, block_x + ray_index % block_w, block_y + ray_index / block_w);
+                write_pixel_color(pixel, pixel_colors[ray_index]);
+            }
+        }
+    }
+}
+
+// All samples of tile are traced by wavefront integrator, in waves of up to WAVEFRONT_MAX_PATH_COUNT paths.
+// Paths are generated sample by sample, so neighbouring paths start from neighbouring pixels
+static void 
+render_tile_wavefront(RenderWorkQueue *queue, RenderWorkOrder *order, RayCastData data, BVHEntryNodes *entry) {
+    u32 tile_w = order->x_max - order->x_min;
+    u32 tile_h = order->y_max - order->y_min;
+    u32 pixel_count = tile_w * tile_h;
+    u64 path_count = (u64)pixel_count * queue->samples_per_pixel;
+    f32 color_multiplier = 1.0f / (f32)queue->samples_per_pixel;
+    
+    Wavefront wavefront = wavefront_init(queue->world, path_count < WAVEFRONT_MAX_PATH_COUNT ? (u32)path_count : WAVEFRONT_MAX_PATH_COUNT);
+    Vec3 *pixel_colors = calloc(pixel_count, sizeof(Vec3));
+    for (u64 wave_start = 0;
+         wave_start < path_count;
+         wave_start += wavefront.capacity) {
+        WavefrontPaths *paths = &wavefront.paths;
+        paths->count = 0;
+        for (u64 path_index = wave_start;
+             path_index < path_count && paths->count < wavefront.capacity;
+             ++path_index) {
+            u32 pixel_index = (u32)(path_index % pixel_count);
+            u32 x = order->x_min + pixel_index % tile_w;
+            u32 y = order->y_min + pixel_index / tile_w;
+            f32 u = ((f32)x + randomu(&order->entropy)) / (f32)queue->output->w;
+            f32 v = ((f32)y + randomu(&order->entropy)) / (f32)queue->output->h;
+            
+            paths->ray[paths->count] = camera_make_ray(&queue->world->camera, &order->entropy, u, v);
+            paths->throughput[paths->count] = v3s(1.0f);
+            paths->radiance[paths->count] = v3s(0);
+            paths->pixel_index[paths->count] = pixel_index;
+            ++paths->count;
+        }
+        
+        wavefront_trace(queue->world, &wavefront, queue->max_bounce_count, entry, pixel_colors, color_multiplier, data);
     }
     
-    RenderWorkOrder *order = queue->orders + work_order_index;
+    for (u32 pixel_index = 0;
+         pixel_index < pixel_count;
+         ++pixel_index) {
+        u32 *pixel = image_get_pixel_pointer(queue->output, order->x_min + pixel_index % tile_w, order->y_min + pixel_index / tile_w);
+        write_pixel_color(pixel, pixel_colors[pixel_index]);
+    }
+    
+    free(pixel_colors);
+    wavefront_free(&wavefront);
+}
+
+void 
+render_tile(RenderWorkQueue *queue, u32 order_index) {
+    RenderWorkOrder *order = queue->orders + order_index;
     u32 samples = queue->samples_per_pixel;
     u32 bounces = queue->max_bounce_count;
     
     RayCastStatistics tile_stats = {0};
-    for (u32 y = order->y_min;
-         y < order->y_max;
-         ++y) {
-        u32 *pixel = image_get_pixel_pointer(queue->output, order->x_min, y);
-             
-        for (u32 x = order->x_min;
-             x < order->x_max;
-             ++x) {
-            Vec3 pixel_color = v3(0, 0, 0);
-            
-            f32 color_multiplier = 1.0f / (f32)samples;
-            for (u32 sample_index = 0;
-                sample_index < samples;
-                ++sample_index) {
-                f32 u = ((f32)x + randomu(&order->entropy)) / (f32)queue->output->w;
-                f32 v = ((f32)y + randomu(&order->entropy)) / (f32)queue->output->h;
-                Ray ray = camera_make_ray(&queue->world->camera, &order->entropy, u, v);
-                
-                RayCastData data;
-                data.entropy = &order->entropy;
-                data.arena = &order->arena;
-                data.stats = &tile_stats;
+    RayCastData data;
+    data.entropy = &order->entropy;
+    data.arena = &order->arena;
+    data.stats = &tile_stats;
+    
+    // Camera rays of tile only can hit part of scene, so root hierarchy is culled against tile frustum once
+    BVHEntryNodes entry_nodes;
+    BVHEntryNodes *entry = 0;
+    Frustum frustum;
+    if (camera_make_frustum(&queue->world->camera, 
+                            (f32)order->x_min / (f32)queue->output->w, (f32)order->y_min / (f32)queue->output->h,
+                            (f32)order->x_max / (f32)queue->output->w, (f32)order->y_max / (f32)queue->output->h,
+                            &frustum) && 
+        world_frustum_entry_nodes(queue->world, &frustum, &entry_nodes)) {
+        entry = &entry_nodes;
+    }
+    
+    if (queue->use_wavefront) {
+        render_tile_wavefront(queue, order, data, entry);
+    } else if (queue->packet_size > 1) {
+        render_tile_packets(queue, order, data, entry);
+    } else {
+        for (u32 y = order->y_min;
+             y < order->y_max;
+             ++y) {
+            u32 *pixel = image_get_pixel_pointer(queue->output, order->x_min, y);
+                 
+            for (u32 x = order->x_min;
+                 x < order->x_max;
+                 ++x) {
+                Vec3 pixel_color = v3(0, 0, 0);
                 
-                Vec3 sample_color = ray_cast(queue->world, ray, bounces, data);
-                // Remove NaNs
-                if (!isfinite(sample_color.r)) { sample_color.r = 0; }
-                if (!isfinite(sample_color.g)) { sample_color.g = 0; }
-                if (!isfinite(sample_color.b)) { sample_color.b = 0; }
+                f32 color_multiplier = 1.0f / (f32)samples;
+                for (u32 sample_index = 0;
+                    sample_index < samples;
+                    ++sample_index) {
+                    f32 u = ((f32)x + randomu(&order->entropy)) / (f32)queue->output->w;
+                    f32 v = ((f32)y + randomu(&order->entropy)) / (f32)queue->output->h;
+                    Ray ray = camera_make_ray(&queue->world->camera, &order->entropy, u, v);
+                    
+                    HitRecord hrec = {0};
+                    bool has_hit = false;
+                    if (bounces) {
+                        has_hit = world_camera_ray_hit(queue->world, ray, entry, &hrec, data);
+                    }
+                    Vec3 sample_color = ray_cast_from_hit(queue->world, ray, has_hit, hrec, bounces, data);
+                    sample_color = sample_color_remove_nans(sample_color);
+                    pixel_color = v3add(pixel_color, v3muls(sample_color, color_multiplier));
+                }
                 
-            
-                pixel_color = v3add(pixel_color, v3muls(sample_color, color_multiplier));
-            }
-            
-            f32 r = linear1_to_srgb1(saturate(pixel_color.r));
-            f32 g = linear1_to_srgb1(saturate(pixel_color.g));
-            f32 b = linear1_to_srgb1(saturate(pixel_color.b));
-            *pixel++ = rgba_pack_4x8_linear1(b, g, r, 1.0f);     
-        }        
+                write_pixel_color(pixel++, pixel_color);
+            }        
+        }
     }
     
-    atomic_add64(&queue->orders_done, 1);
     // @HACK increment all stats counters cause they are all u64s
     for (u32 it_idx = 0;
          it_idx < sizeof(tile_stats) / sizeof(u64);
@@ -69,22 +192,34 @@ render_tile(RenderWorkQueue *queue) {
         u64 *src_orign = (u64 *)&tile_stats; 
         atomic_add64(dst_origin + it_idx, *(src_orign + it_idx));        
     }
-    
-    return true;
+    atomic_add64(&queue->orders_done, 1);
 }
 
-static THREAD_PROC_SIGNATURE(render_thread_proc) {
+static JOB_PROC_SIGNATURE(render_tile_job_proc) {
     RenderWorkQueue *queue = param;
+    render_tile(queue, job_index);
     
-    while (render_tile(queue)) { }
-    
-    exit_thread();
-    return 0;
+    // Progress is printed by whichever thread finished tile
+    if (queue->show_progress) {
+        f32 percent = (f32)queue->orders_done / (f32)queue->order_count;
+        printf("\rRaycasting %u%%", (u32)roundf(percent * 100));
+        fflush(stdout);
+    }
+}
+
+// Renders all tiles of queue. Tiles are jobs of run_parallel_jobs, so threads are kept between frames,
+// and all of them are done with queue when it returns
+static void
+render_all_tiles(RenderWorkQueue *queue, u32 thread_count, bool show_progress) {
+    memset((void *)&queue->stats, 0, sizeof(queue->stats));
+    queue->orders_done = 0;
+    queue->show_progress = show_progress;
+    run_parallel_jobs(render_tile_job_proc, queue, queue->order_count, thread_count);
 }
 
 void 
 init_render_queue(RenderWorkQueue *queue, Image *image, World *world,
-                  u32 tile_w, u32 tile_h, u32 samples_per_pixel, u32 max_bounce_count) {
+                  u32 tile_w, u32 tile_h, u32 samples_per_pixel, u32 max_bounce_count, u32 packet_size, bool use_wavefront) {
     memset(queue, 0, sizeof(*queue));
     // Ceil integer division
     u32 tile_count_x = (image->w + tile_w - 1) / tile_w;
@@ -95,6 +230,8 @@ init_render_queue(RenderWorkQueue *queue, Image *image, World *world,
     queue->world = world;
     queue->samples_per_pixel = samples_per_pixel;
     queue->max_bounce_count = max_bounce_count;
+    queue->packet_size = packet_size;
+    queue->use_wavefront = use_wavefront;
     queue->order_count = tile_count;
     queue->orders = malloc(sizeof(RenderWorkOrder) * queue->order_count);
     
@@ -133,6 +270,134 @@ init_render_queue(RenderWorkQueue *queue, Image *image, World *world,
     assert(cursor == queue->order_count);
 }
 
+static void
+print_bvh_report(u32 obj_index, char *kind, u32 segment_index, BVH *bvh, FILE *json, bool is_first) {
+    BVHReport report;
+    bvh_report(bvh, &report);
+    u64 node_memory = bvh->node_count * sizeof(BVHNode) + bvh->wide_node_count * 
+        (bvh->compressed_nodes ? sizeof(BVHCompressedNode) : sizeof(BVHWideNode)) + 
+        (bvh->end_bounds ? bvh->node_count * sizeof(Bounds3) : 0);
+    u64 traversal_node_memory = bvh_traversal_node_memory(bvh);
+    
+    char bytes_buffer[32];
+    char traversal_bytes_buffer[32];
+    format_bytes(bytes_buffer, sizeof(bytes_buffer), node_memory);
+    format_bytes(traversal_bytes_buffer, sizeof(traversal_bytes_buffer), traversal_node_memory);
+    printf("BVH report: object %u (%s", obj_index, kind);
+    if (bvh->end_bounds) {
+        printf(", time segment %u", segment_index);
+    }
+    printf(")\n");
+    printf("    Build time: %.2fms%s\n", bvh->build_time_ms, bvh->is_cached ? " (loaded from cache)" : "");
+    printf("    Nodes: %u, leaves: %u, references: %u, levels: %u\n", bvh->node_count, report.leaf_count, 
+           bvh->prim_count, report.level_count);
+    printf("    Node memory: %s, traversed: %s\n", bytes_buffer, traversal_bytes_buffer);
+    printf("    SAH cost: %.2f\n", report.sah_cost);
+    printf("    Sibling overlap: %.2f%%\n", 100.0f * report.overlap_ratio);
+    printf("    Leaf depth histogram:");
+    for (u32 depth = 0;
+         depth < report.level_count;
+         ++depth) {
+        if (report.levels[depth].leaf_count) {
+            printf(" %u:%u", depth, report.levels[depth].leaf_count);
+        }
+    }
+    printf("\n    Leaf size histogram:");
+    for (u32 leaf_size = 0;
+         leaf_size <= BVH_REPORT_MAX_LEAF_SIZE;
+         ++leaf_size) {
+        if (report.leaf_size_histogram[leaf_size]) {
+            printf(" %u%s:%u", leaf_size, leaf_size == BVH_REPORT_MAX_LEAF_SIZE ? "+" : "", report.leaf_size_histogram[leaf_size]);
+        }
+    }
+    printf("\n");
+    
+    if (json) {
+        fprintf(json, "%s\n  {\"object\": %u, \"kind\": \"%s\", \"segment\": %u, \"nodes\": %u, \"leaves\": %u, \"references\": %u, "
+                "\"sah_cost\": %f, \"overlap_ratio\": %f, \"node_memory\": %llu, \"traversal_node_memory\": %llu, "
+                "\"build_time_ms\": %f, \"cached\": %s,\n   \"leaf_size_histogram\": [", 
+                is_first ? "" : ",", obj_index, kind, segment_index, bvh->node_count, report.leaf_count, bvh->prim_count,
+                report.sah_cost, report.overlap_ratio, (unsigned long long)node_memory, (unsigned long long)traversal_node_memory, 
+                bvh->build_time_ms, bvh->is_cached ? "true" : "false");
+        for (u32 leaf_size = 0;
+             leaf_size <= BVH_REPORT_MAX_LEAF_SIZE;
+             ++leaf_size) {
+            fprintf(json, "%s%u", leaf_size ? ", " : "", report.leaf_size_histogram[leaf_size]);
+        }
+        fprintf(json, "],\n   \"levels\": [");
+        for (u32 depth = 0;
+             depth < report.level_count;
+             ++depth) {
+            BVHLevelReport *level = report.levels + depth;
+            fprintf(json, "%s\n    {\"depth\": %u, \"nodes\": %u, \"leaves\": %u, \"prims\": %u, \"area\": %f, \"overlap_area\": %f}",
+                    depth ? "," : "", depth, level->node_count, level->leaf_count, level->prim_count, level->area, level->overlap_area);
+        }
+        fprintf(json, "]}");
+    }
+}
+
+// Prints report of every hierarchy in world, and writes it as JSON array to json_filename if it is set
+static void
+print_bvh_reports(World *world, char *json_filename) {
+    FILE *json = 0;
+    if (json_filename) {
+        json = fopen(json_filename, "w");
+        if (json) {
+            fprintf(json, "[");
+        } else {
+            fprintf(stderr, "[ERROR] Failed to open %s\n", json_filename);
+        }
+    }
+    
+    bool is_first = true;
+    for (u32 obj_index = 0;
+         obj_index < world->objects_size;
+         ++obj_index) {
+        Object *obj = world->objects + obj_index;
+        switch (obj->type) {
+            case ObjectType_BVH: {
+                print_bvh_report(obj_index, "objects", 0, &obj->bvh.tree, json, is_first);
+                is_first = false;
+            } break;
+            case ObjectType_InstanceBVH: {
+                print_bvh_report(obj_index, "instances", 0, &obj->instance_bvh.tree, json, is_first);
+                is_first = false;
+            } break;
+            case ObjectType_TriangleMesh: {
+                print_bvh_report(obj_index, "mesh", 0, &obj->triangle_mesh.bvh, json, is_first);
+                is_first = false;
+            } break;
+            case ObjectType_MotionBVH: {
+                for (u32 segment_index = 0;
+                     segment_index < obj->motion_bvh.segment_count;
+                     ++segment_index) {
+                    print_bvh_report(obj_index, "motion", segment_index, &obj->motion_bvh.segments[segment_index].tree, 
+                                     json, is_first);
+                    is_first = false;
+                }
+            } break;
+            default: {
+            } break;
+        }
+    }
+    
+    if (json) {
+        fprintf(json, "\n]\n");
+        fclose(json);
+    }
+}
+
+// Frames after first one are saved next to it, with frame index inserted before extension
+static void
+make_frame_filename(char *buffer, u32 buffer_size, char *filename, u32 frame_index) {
+    char *extension = strrchr(filename, '.');
+    if (extension && (strchr(extension, '/') || strchr(extension, '\\'))) {
+        extension = 0;
+    }
+    u32 name_length = extension ? (u32)(extension - filename) : (u32)strlen(filename);
+    snprintf(buffer, buffer_size, "%.*s_%04u%s", name_length, filename, frame_index, extension ? extension : "");
+}
+
 static void
 parse_command_line_arguments(u32 argc, char **argv, RaySettings *s) {
     u32 cursor = 1;
@@ -176,12 +441,92 @@ parse_command_line_arguments(u32 argc, char **argv, RaySettings *s) {
             s->max_bounce_count = v;
             
             cursor += 2;
+        } else if (!strcmp(arg, "-packet")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            u32 v = atoi(argv[cursor + 1]);
+            if (v == 1 || v == 4 || v == 8 || v == 16) {
+                s->packet_size = v;
+            } else {
+                fprintf(stderr, "[ERROR] Packet size must be 1, 4, 8 or 16, got %s\n", argv[cursor + 1]);
+            }
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-wavefront")) {
+            s->use_wavefront = true;
+            
+            ++cursor;
         } else if (!strcmp(arg, "-threads")) {
             CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
             
             u32 v = atoi(argv[cursor + 1]);
             s->thread_count = v;
             
+            cursor += 2;
+        } else if (!strcmp(arg, "-bvh-build")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            if (!bvh_build_method_from_string(argv[cursor + 1], &s->bvh_build_method)) {
+                fprintf(stderr, "[ERROR] Unknown BVH build method %s\n", argv[cursor + 1]);
+            }
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-bvh-spatial-budget")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            f32 v = atof(argv[cursor + 1]);
+            s->bvh_spatial_split_budget = v;
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-bvh-optimize")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            u32 v = atoi(argv[cursor + 1]);
+            s->bvh_optimize_pass_count = v;
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-bvh-cache")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            s->bvh_cache_directory = argv[cursor + 1];
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-bvh-report")) {
+            s->bvh_report = true;
+            
+            ++cursor;
+        } else if (!strcmp(arg, "-bvh-report-json")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            s->bvh_report = true;
+            s->bvh_report_json_filename = argv[cursor + 1];
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-bvh-layout")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            if (!bvh_layout_from_string(argv[cursor + 1], &s->bvh_layout)) {
+                fprintf(stderr, "[ERROR] Unknown BVH layout %s\n", argv[cursor + 1]);
+            }
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-frames")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            u32 v = atoi(argv[cursor + 1]);
+            if (v) {
+                s->frame_count = v;
+            } else {
+                fprintf(stderr, "[ERROR] Frame count must be positive, got %s\n", argv[cursor + 1]);
+            }
+            
+            cursor += 2;
+        } else if (!strcmp(arg, "-frame-time")) {
+            CHECK_HAS_ENOUGH_ARGS_OR_ERROR(1);
+            
+            f32 v = atof(argv[cursor + 1]);
+            s->frame_time = v;
+            
             cursor += 2;
         } else if (!strcmp(arg, "-open")) {
             s->open_image_after_done = true;
@@ -205,10 +550,16 @@ main(int argc, char **argv) {
     s.image_filename = "out.bmp";
     s.samples_per_pixel = 32;
     s.max_bounce_count = 16;
+    s.packet_size = 1;
     s.open_image_after_done = true;
     s.thread_count = 6;
     s.tile_w = 64;
     s.tile_h = 6;
+    s.bvh_build_method = BVHBuildMethod_BinnedSAH;
+    s.bvh_layout = BVHLayout_Binary;
+    s.bvh_spatial_split_budget = 1.5f;
+    s.frame_count = 1;
+    s.frame_time = 1.0f / 24.0f;
     parse_command_line_arguments(argc, argv, &s);
     
     seed_rng(&rng, time(0));
@@ -217,14 +568,26 @@ main(int argc, char **argv) {
     // Initialize world
     World world;
     world_init(&world);
+    world.bvh_settings.method = s.bvh_build_method;
+    world.bvh_settings.layout = s.bvh_layout;
+    world.bvh_settings.spatial_split_budget = s.bvh_spatial_split_budget;
+    world.bvh_settings.thread_count = s.thread_count;
+    world.bvh_settings.optimize_pass_count = s.bvh_optimize_pass_count;
+    world.bvh_settings.cache_directory = s.bvh_cache_directory;
+    world.bvh_settings.report = s.bvh_report;
     init_cornell_box(&world, &output_image);
     validate_world(&world);
+    world_commit(&world);
     // Print world information    
     char bytes_buffer[32];
     format_bytes(bytes_buffer, sizeof(bytes_buffer), world.arena.data_size);
     printf("Scene memory taken: %s\n", bytes_buffer);
     format_bytes(bytes_buffer, sizeof(bytes_buffer), world.arena.peak_size);
     printf("Scene memory peak size: %s\n", bytes_buffer);
+    format_bytes(bytes_buffer, sizeof(bytes_buffer), world.bvh_node_memory);
+    printf("BVH node memory: %s\n", bytes_buffer);
+    format_bytes(bytes_buffer, sizeof(bytes_buffer), world.bvh_traversal_node_memory);
+    printf("BVH traversed node memory: %s\n", bytes_buffer);
     
     printf("Scene object count: %llu\n", world.objects_size);
     printf("Scene texture count: %llu\n", world.textures_size);
@@ -232,33 +595,41 @@ main(int argc, char **argv) {
     printf("Thread count: %u\n", s.thread_count);
     printf("Image size: %ux%u\n", s.image_w, s.image_h);
     printf("Samples per pixel: %u\n", s.samples_per_pixel);
+    if (s.frame_count > 1) {
+        printf("Frame count: %u, frame time: %.4fs\n", s.frame_count, s.frame_time);
+    }
     printf("Max bounce count: %u\n", s.max_bounce_count);
+    printf("Primary ray packet size: %u\n", s.packet_size);
+    printf("Use wavefront integrator: %s\n", bool_to_cstring(s.use_wavefront));
     printf("Use importance sampling: %s\n", bool_to_cstring(world.has_importance_sampling));
+    printf("BVH build method: %s\n", bvh_build_method_to_string(world.bvh_settings.method));
+    printf("BVH layout: %s\n", bvh_layout_to_string(world.bvh_settings.layout));
+    if (world.bvh_settings.method == BVHBuildMethod_SpatialSplit) {
+        printf("BVH spatial split budget: %.2f\n", world.bvh_settings.spatial_split_budget);
+    }
+    if (world.bvh_settings.optimize_pass_count) {
+        printf("BVH optimization passes: %u\n", world.bvh_settings.optimize_pass_count);
+    }
+    if (world.bvh_settings.cache_directory) {
+        printf("BVH cache directory: %s\n", world.bvh_settings.cache_directory);
+    }
+    if (s.bvh_report) {
+        print_bvh_reports(&world, s.bvh_report_json_filename);
+    }
     // Initialize multihtreaded work queue
     RenderWorkQueue render_queue;
     init_render_queue(&render_queue, &output_image, &world,
-                      s.tile_w, s.tile_h, s.samples_per_pixel, s.max_bounce_count);
+                      s.tile_w, s.tile_h, s.samples_per_pixel, s.max_bounce_count, s.packet_size, s.use_wavefront);
     
     printf("Start raycasting\n");
     clock_t start_clock = clock();
+    // clock() sums time of all threads on POSIX, so throughput is measured by wall clock
+    f64 render_start = get_wall_clock_ms();
     
-    // Create threads, they start working immediately
-    for (u32 core_index = 1;
-         core_index < s.thread_count;
-         ++core_index) {
-        create_thread(render_thread_proc, &render_queue);
-    }
-    
-    // Keep maint thread busy
-    while (render_queue.orders_done < render_queue.order_count) {
-        if (render_tile(&render_queue)) {
-            f32 percent = (f32)render_queue.orders_done / (f32)render_queue.order_count;
-            printf("\rRaycasting %u%%", (u32)roundf(percent * 100));
-            fflush(stdout);
-        } 
-    }
+    render_all_tiles(&render_queue, s.thread_count, true);
     printf("\nRaycasting done\n");
     
+    f64 render_time = get_wall_clock_ms() - render_start;
     clock_t end_clock = clock();
     clock_t elapsed = end_clock - start_clock;
     u64 time_elapsed = (u64)(elapsed * 1000 / CLOCKS_PER_SEC);
@@ -281,12 +652,37 @@ main(int argc, char **argv) {
     format_number_with_thousand_separators(number_buffer, sizeof(number_buffer), render_queue.stats.object_collision_tests);
     printf("Object collision tests: %s\n", number_buffer);
     printf("Object collision tests failed: %.2f%%\n", 100.0f * (1.0 - (f64)render_queue.stats.object_collision_test_successes / (f64)render_queue.stats.object_collision_tests));
+    format_number_with_thousand_separators(number_buffer, sizeof(number_buffer), render_queue.stats.bvh_node_visits);
+    printf("BVH node visits: %s (%.2f/bounce)\n", number_buffer, (f64)render_queue.stats.bvh_node_visits / (f64)render_queue.stats.bounce_count);
+    format_number_with_thousand_separators(number_buffer, sizeof(number_buffer), render_queue.stats.bvh_box_tests);
+    printf("BVH box tests: %s (%.2f/bounce)\n", number_buffer, (f64)render_queue.stats.bvh_box_tests / (f64)render_queue.stats.bounce_count);
+    if (render_time > 0) {
+        printf("BVH traversal throughput: %.2f Mnodes/s\n", (f64)render_queue.stats.bvh_node_visits / (render_time * 1000.0));
+    }
     printf("Average bounce count per ray: %f\n", (f64)render_queue.stats.bounce_count / (f64)(s.samples_per_pixel * output_image.w * output_image.h));
     printf("Russian roulette terminated bounces: %llu (%.2f%%)\n", render_queue.stats.russian_roulette_terminated_bounces, (f64)render_queue.stats.russian_roulette_terminated_bounces / (f64)primary_ray_count);
     
     char *out = s.image_filename;
     image_save(&output_image, out);
     
+    // Objects of animated scene only move between frames, so hierarchies are refitted instead of being built again
+    for (u32 frame_index = 1;
+         frame_index < s.frame_count;
+         ++frame_index) {
+        f64 update_start = get_wall_clock_ms();
+        world_update(&world, (f32)frame_index * s.frame_time);
+        f64 update_time = get_wall_clock_ms() - update_start;
+        
+        f64 render_start = get_wall_clock_ms();
+        render_all_tiles(&render_queue, s.thread_count, false);
+        f64 render_time = get_wall_clock_ms() - render_start;
+        
+        char frame_filename[256];
+        make_frame_filename(frame_filename, sizeof(frame_filename), s.image_filename, frame_index);
+        image_save(&output_image, frame_filename);
+        printf("Frame %u: update %.2fms, raycasting %.2fms, saved to %s\n", frame_index, update_time, render_time, frame_filename);
+    }
+    
 #if OS_WINDOWS
     if (s.open_image_after_done) {
         char command[32];
@@ -6,6 +6,7 @@
 #include "ray_misc.h"
 #include "image.h"
 #include "trace.h"
+#include "wavefront.h"
 #include "perlin.h"
 #include "obj.h"
 
@@ -29,13 +30,16 @@ typedef struct {
     // Some settings, they also could be global variables, but its cleaner to put them here
     u32 samples_per_pixel;
     u32 max_bounce_count;
+    // Camera rays are traced in packets of this size, 1 means single rays
+    u32 packet_size;
+    // Tiles are rendered by wavefront integrator instead of tracing each sample to the end
+    bool use_wavefront;
     
     RenderWorkOrder *orders;
     u32 order_count;
-    // Incremented as new work order is being picked by working thread
-    volatile u64 next_order_index;
-    // Incremented as order is done. If is equal to order count, queue has finished all jobs
+    // Incremented as order is done, used to show progress
     volatile u64 orders_done;
+    bool show_progress;
     
     volatile RayCastStatistics stats;
 } RenderWorkQueue;
@@ -49,13 +53,30 @@ typedef struct {
     u32 thread_count;
     u32 samples_per_pixel;
     u32 max_bounce_count;
+    // 1, 4, 8 or 16
+    u32 packet_size;
+    bool use_wavefront;
     u32 tile_w;
     u32 tile_h;
+    BVHBuildMethod bvh_build_method;
+    BVHLayout bvh_layout;
+    f32 bvh_spatial_split_budget;
+    u32 bvh_optimize_pass_count;
+    // If set, built hierarchies are cached in this directory
+    char *bvh_cache_directory;
+    // Print build statistics and quality report of every hierarchy in world before rendering
+    bool bvh_report;
+    // If set, report with per-level statistics is also written to this file as JSON
+    char *bvh_report_json_filename;
+    // Scenes with animation are advanced by frame_time between frames.
+    // First frame is saved to image_filename, next ones get frame index appended to it
+    u32 frame_count;
+    f32 frame_time;
 } RaySettings;
 
-bool render_tile(RenderWorkQueue *queue);
+void render_tile(RenderWorkQueue *queue, u32 order_index);
 void init_render_queue(RenderWorkQueue *queue, Image *image, World *world,
-                       u32 tile_w, u32 tile_h, u32 samples_per_pixel, u32 max_bounce_count);
+                       u32 tile_w, u32 tile_h, u32 samples_per_pixel, u32 max_bounce_count, u32 packet_size, bool use_wavefront);
 
 #define RAY_H 1
 #endif
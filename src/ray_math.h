@@ -669,7 +669,12 @@ bounds3_extend(Bounds3 a, Vec3 p) {
 static inline f32 
 bound3s_surface_area(Bounds3 b) {
     Vec3 d = v3sub(b.max, b.min);
-    return 2 * (d.x * d.y + d.y * d.z + d.z * d.z);
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static inline Vec3 
+bounds3_center(Bounds3 b) {
+    return v3muls(v3add(b.min, b.max), 0.5f);
 }
 
 static inline u32 
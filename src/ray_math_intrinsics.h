@@ -9,6 +9,9 @@
 #include <x86intrin.h>
 #elif COMPILER_MSVC 
 #include <xmmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif 
 #endif 
 
 #define USE_MATH_H 0
@@ -36,6 +36,58 @@ get_core_count(void) {
 	return info.dwNumberOfProcessors;
 }
 
+f64 
+get_wall_clock_ms(void) {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (f64)counter.QuadPart * 1000.0 / (f64)frequency.QuadPart;
+}
+
+void *
+map_file(char *filename, u64 *size) {
+    void *result = 0;
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER file_size;
+        if (GetFileSizeEx(file, &file_size) && file_size.QuadPart) {
+            HANDLE mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+            if (mapping) {
+                result = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+                *size = file_size.QuadPart;
+                // View keeps mapping alive
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+    return result;
+}
+
+void 
+unmap_file(void *memory, u64 size) {
+    UnmapViewOfFile(memory);
+}
+
+typedef struct {
+    HANDLE handle;
+} Semaphore;
+
+static void
+semaphore_init(Semaphore *semaphore) {
+    semaphore->handle = CreateSemaphoreA(0, 0, I32_MAX, 0);
+}
+
+static void
+semaphore_signal(Semaphore *semaphore, u32 count) {
+    ReleaseSemaphore(semaphore->handle, count, 0);
+}
+
+static void
+semaphore_wait(Semaphore *semaphore) {
+    WaitForSingleObject(semaphore->handle, INFINITE);
+}
+
 u32 
 get_thread_id(void) {
 	// @NOTE this is basically GetThreadID function disassembly made with intrinsics
@@ -48,6 +100,9 @@ get_thread_id(void) {
 
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 u64
 atomic_add64(volatile u64 *value, u64 addend) {
@@ -62,6 +117,8 @@ create_thread(ThreadProc *proc, void *param) {
     CT_ASSERT(sizeof(result) >= sizeof(pthread_t));
     bool success = pthread_create((pthread_t *)&result, 0, proc, param);
 	assert(!success);
+    // Nobody joins our threads, so let system free their resources on exit
+    pthread_detach(*(pthread_t *)&result);
 
 	return result;
 }
@@ -76,6 +133,162 @@ get_core_count(void) {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+f64 
+get_wall_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (f64)ts.tv_sec * 1000.0 + (f64)ts.tv_nsec / 1000000.0;
+}
+
+void *
+map_file(char *filename, u64 *size) {
+    void *result = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (!fstat(fd, &st) && st.st_size) {
+            void *memory = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (memory != MAP_FAILED) {
+                result = memory;
+                *size = st.st_size;
+            }
+        }
+        // Mapping stays valid after descriptor is closed
+        close(fd);
+    }
+    return result;
+}
+
+void 
+unmap_file(void *memory, u64 size) {
+    munmap(memory, size);
+}
+
+// Unnamed POSIX semaphores are not supported on macOS, so semaphore is made of mutex and condition variable
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    u32 count;
+} Semaphore;
+
+static void
+semaphore_init(Semaphore *semaphore) {
+    pthread_mutex_init(&semaphore->mutex, 0);
+    pthread_cond_init(&semaphore->cond, 0);
+    semaphore->count = 0;
+}
+
+static void
+semaphore_signal(Semaphore *semaphore, u32 count) {
+    pthread_mutex_lock(&semaphore->mutex);
+    semaphore->count += count;
+    pthread_cond_broadcast(&semaphore->cond);
+    pthread_mutex_unlock(&semaphore->mutex);
+}
+
+static void
+semaphore_wait(Semaphore *semaphore) {
+    pthread_mutex_lock(&semaphore->mutex);
+    while (!semaphore->count) {
+        pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+    }
+    --semaphore->count;
+    pthread_mutex_unlock(&semaphore->mutex);
+}
+
 #else 
 #error !
 #endif 
+
+typedef struct {
+    JobProc *proc;
+    void *param;
+    u32 job_count;
+    // Incremented as new job is being picked by thread
+    volatile u64 next_job_index;
+} JobQueue;
+
+// Worker threads are created on first use and then sleep between calls of run_parallel_jobs,
+// so code that runs jobs often (like refitting every frame) does not pay for thread creation each time
+typedef struct {
+    // Set while some thread runs jobs on pool, nested or concurrent calls run their jobs on calling thread
+    volatile u64 is_busy;
+    bool is_initialized;
+    u32 worker_count;
+    JobQueue *queue;
+    // Signaled once per worker that should take part in current queue
+    Semaphore work_ready;
+    // Signaled by worker when it has no more jobs. Queue lives on stack of calling thread,
+    // so it can't return until all woken workers stopped using it
+    Semaphore work_done;
+} JobPool;
+
+static JobPool global_job_pool;
+
+static bool 
+do_next_job(JobQueue *queue) {
+    u64 job_index = atomic_add64(&queue->next_job_index, 1);
+    if (job_index >= queue->job_count) {
+        return false;
+    }
+    
+    queue->proc(queue->param, job_index);
+    return true;
+}
+
+static THREAD_PROC_SIGNATURE(job_thread_proc) {
+    JobPool *pool = param;
+    
+    for (;;) {
+        semaphore_wait(&pool->work_ready);
+        while (do_next_job(pool->queue)) { }
+        semaphore_signal(&pool->work_done, 1);
+    }
+    
+    return 0;
+}
+
+void 
+run_parallel_jobs(JobProc *proc, void *param, u32 job_count, u32 thread_count) {
+    JobQueue queue = {0};
+    queue.proc = proc;
+    queue.param = param;
+    queue.job_count = job_count;
+    
+    JobPool *pool = &global_job_pool;
+    u32 worker_count = 0;
+    if (thread_count > 1 && job_count > 1) {
+        if (atomic_add64(&pool->is_busy, 1) == 0) {
+            worker_count = (thread_count < job_count ? thread_count : job_count) - 1;
+        } else {
+            atomic_add64(&pool->is_busy, -1);
+        }
+    }
+    
+    if (worker_count) {
+        if (!pool->is_initialized) {
+            semaphore_init(&pool->work_ready);
+            semaphore_init(&pool->work_done);
+            pool->is_initialized = true;
+        }
+        while (pool->worker_count < worker_count) {
+            create_thread(job_thread_proc, pool);
+            ++pool->worker_count;
+        }
+        
+        pool->queue = &queue;
+        semaphore_signal(&pool->work_ready, worker_count);
+    }
+    
+    while (do_next_job(&queue)) { }
+    
+    if (worker_count) {
+        for (u32 worker_index = 0;
+             worker_index < worker_count;
+             ++worker_index) {
+            semaphore_wait(&pool->work_done);
+        }
+        pool->queue = 0;
+        atomic_add64(&pool->is_busy, -1);
+    }
+}
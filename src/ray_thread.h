@@ -18,6 +18,19 @@ typedef struct {
 Thread create_thread(ThreadProc *proc, void *param);
 void exit_thread(void);
 u32 get_core_count(void);
+// Monotonic wall clock time, used for profiling multithreaded code where clock() is not useful
+f64 get_wall_clock_ms(void);
+// Maps whole file to memory. Mapping is private copy-on-write, so modifications are not written to file.
+// Returns 0 if file can't be mapped
+void *map_file(char *filename, u64 *size);
+// Releases mapping made by map_file, size is size returned by it
+void unmap_file(void *memory, u64 size);
+
+#define JOB_PROC_SIGNATURE(_name) void _name(void *param, u32 job_index)
+typedef JOB_PROC_SIGNATURE(JobProc);
+// Calls proc for each job index in range [0; job_count) on up to thread_count threads.
+// Calling thread participates in work too. Returns when all jobs are done
+void run_parallel_jobs(JobProc *proc, void *param, u32 job_count, u32 thread_count);
 
 static inline u32 get_thread_id(void);
 
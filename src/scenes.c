@@ -384,3 +384,73 @@ init_scene_test_light(World *world, Image *image) {
     f32 aperture = 0.0f;
     world->camera = camera_perspective(look_from, look_at, v_up, aspect_ratio, rad(36.7), aperture, dtf, 0, 1);
 }
+
+// Instances bounce in a wave running along the grid
+static f32
+scene_instances_height(f32 x, f32 z, f32 time) {
+    return 0.2f + 0.3f * fabsf(sinf(time * 4.0f + x * 0.5f - z));
+}
+
+// Instances only move, so instance hierarchy is refitted
+static SCENE_UPDATE_PROC_SIGNATURE(update_scene_instances) {
+    for (u32 obj_index = 0;
+         obj_index < world->objects_size;
+         ++obj_index) {
+        Object *obj = world->objects + obj_index;
+        if (obj->type == ObjectType_InstanceBVH) {
+            for (u32 instance_index = 0;
+                 instance_index < obj->instance_bvh.tree.prim_count;
+                 ++instance_index) {
+                Transform *t = &obj->instance_bvh.instances[instance_index].t;
+                t->o2w.e[3][1] = scene_instances_height(t->o2w.e[3][0], t->o2w.e[3][2], time);
+                t->w2o = mat4x4_inverse(t->o2w);
+            }
+            ObjectHandle handle = { obj_index };
+            object_refit_bvh(world, handle);
+        }
+    }
+}
+
+void 
+init_scene_instances(World *world, Image *image) {
+    world->update_scene = update_scene_instances;
+    world->backgorund_color = v3(0.70, 0.80, 1.00);  
+    MaterialHandle ground_mat = material_lambertian(world,
+        texture_checkerboard3d(world,
+        texture_solid(world, v3(0.2, 0.3, 0.1)),
+        texture_solid(world, v3(0.9, 0.9, 0.9))));
+    add_object_to_world(world, object_sphere(world, v3(0, -1000, 0), 1000, ground_mat));
+    
+    // Single mesh is shared by all instances, so memory does not depend on instance count
+    MaterialHandle mesh_mat = material_lambertian(world, texture_solid(world, v3(0.4, 0.2, 0.1)));
+    ObjectHandle mesh = add_poly_sphere(world, 0.2f, 20, mesh_mat);
+    MaterialHandle override_mat = material_metal(world, 0.1f, texture_solid(world, v3(0.7, 0.6, 0.5)));
+    
+    u32 grid_size = 100;
+    ObjectInstance *instances = arena_alloc(&world->arena, sizeof(ObjectInstance) * grid_size * grid_size);
+    u32 instance_count = 0;
+    for (u32 x = 0;
+         x < grid_size;
+         ++x) {
+        for (u32 z = 0;
+             z < grid_size;
+             ++z) {
+            Vec3 t = v3(((f32)x - grid_size * 0.5f) * 0.5f, 0, -((f32)z) * 0.5f);
+            t.y = scene_instances_height(t.x, t.z, 0);
+            Transform transform = transform_t_euler(t, 0, randomu(&rng) * PI, 0);
+            if (randomu(&rng) < 0.2f) {
+                instances[instance_count++] = make_instance_mat(mesh, transform, override_mat);
+            } else {
+                instances[instance_count++] = make_instance(mesh, transform);
+            }
+        }
+    }
+    add_object_to_world(world, object_instance_bvh(world, instances, instance_count));
+    
+    f32 aspect_ratio = (f32)image->w / (f32)image->h;
+    Vec3 look_from = v3(0, 3, 6);
+    Vec3 look_at = v3(0, 0, -4);
+    f32 dtf = 10.0f;
+    f32 aperture = 0.0f;
+    world->camera = camera_perspective(look_from, look_at, v3(0, 1, 0), aspect_ratio, rad(40), aperture, dtf, 0, 1);
+}
@@ -86,26 +86,18 @@ remap_roughness(f32 r, f32 ndoti) {
 
 static bool 
 bounds3_hit(Bounds3 bounds, Ray ray, f32 t_min, f32 t_max) {
-    for (u32 a = 0;
-         a < 3;
-         ++a) {
-        f32 inv_d = 1.0f / ray.dir.e[a];
-        f32 t0 = (bounds.min.e[a] - ray.orig.e[a]) * inv_d;
-        f32 t1 = (bounds.max.e[a] - ray.orig.e[a]) * inv_d;
-        if (inv_d < 0.0f) {
-            f32 temp = t0;
-            t0 = t1;
-            t1 = temp;
-        }
-        
-        t_min = max32(t0, t_min);
-        t_max = min32(t1, t_max);
-        
-        if (t_max < t_min) {
-            return false;
-        }
-    }
-    return true;
+    // Near and far slabs are picked by direction sign, so no swaps are needed
+    Vec3 near = v3(ray.dir_is_neg[0] ? bounds.max.x : bounds.min.x,
+                   ray.dir_is_neg[1] ? bounds.max.y : bounds.min.y,
+                   ray.dir_is_neg[2] ? bounds.max.z : bounds.min.z);
+    Vec3 far = v3(ray.dir_is_neg[0] ? bounds.min.x : bounds.max.x,
+                  ray.dir_is_neg[1] ? bounds.min.y : bounds.max.y,
+                  ray.dir_is_neg[2] ? bounds.min.z : bounds.max.z);
+    Vec3 t0 = v3mul(v3sub(near, ray.orig), ray.inv_dir);
+    Vec3 t1 = v3mul(v3sub(far, ray.orig), ray.inv_dir);
+    t_min = max32(max32(t0.x, t0.y), max32(t0.z, t_min));
+    t_max = min32(min32(t1.x, t1.y), min32(t1.z, t_max));
+    return t_min <= t_max;
 }
 
 static bool 
@@ -138,24 +130,180 @@ triangle_hit(Vec3 p0, Vec3 p1, Vec3 p2, Ray ray, f32 *td, f32 *ud, f32 *vd, RayC
     return result;
 }
 
-static f32 
-triangle_area(Vec3 p0, Vec3 p1, Vec3 p2) {
-    return 0.5f * length(cross(v3sub(p1, p0), v3sub(p2, p0)));
-}
+// Lanes of SIMD kernels, 8-wide with AVX2 and 4-wide with SSE otherwise
+#if defined(__AVX2__)
+#define SIMD_LANE_COUNT 8
+#define lane_f32 __m256
+#define lane_set1 _mm256_set1_ps
+#define lane_load _mm256_loadu_ps
+#define lane_store _mm256_storeu_ps
+#define lane_add _mm256_add_ps
+#define lane_sub _mm256_sub_ps
+#define lane_mul _mm256_mul_ps
+#define lane_div _mm256_div_ps
+#define lane_and _mm256_and_ps
+#define lane_or _mm256_or_ps
+#define lane_min _mm256_min_ps
+#define lane_max _mm256_max_ps
+#define lane_lt(_a, _b) _mm256_cmp_ps(_a, _b, _CMP_LT_OQ)
+#define lane_gt(_a, _b) _mm256_cmp_ps(_a, _b, _CMP_GT_OQ)
+#define lane_le(_a, _b) _mm256_cmp_ps(_a, _b, _CMP_LE_OQ)
+#define lane_movemask _mm256_movemask_ps
+#else 
+#define SIMD_LANE_COUNT 4
+#define lane_f32 __m128
+#define lane_set1 _mm_set1_ps
+#define lane_load _mm_loadu_ps
+#define lane_store _mm_storeu_ps
+#define lane_add _mm_add_ps
+#define lane_sub _mm_sub_ps
+#define lane_mul _mm_mul_ps
+#define lane_div _mm_div_ps
+#define lane_and _mm_and_ps
+#define lane_or _mm_or_ps
+#define lane_min _mm_min_ps
+#define lane_max _mm_max_ps
+#define lane_lt _mm_cmplt_ps
+#define lane_gt _mm_cmpgt_ps
+#define lane_le _mm_cmple_ps
+#define lane_movemask _mm_movemask_ps
+#endif 
+CT_ASSERT(SIMD_LANE_COUNT <= TRIANGLE_SOA_PADDING + 1);
+CT_ASSERT(RAY_PACKET_MAX_SIZE % SIMD_LANE_COUNT == 0);
 
-#define BOX_COMPARATOR_SIGNATURE(_name) int _name(void *w, const void *a, const void *b)
-typedef BOX_COMPARATOR_SIGNATURE(BoxComparator);
+// Same test as triangle_hit, done for SIMD_LANE_COUNT triangles of soa at once.
+// Finds closest of triangles [offset, offset + count) with t in (t_min, t_max), writing its index to hit_index
+static bool 
+triangle_soa_hit(TriangleSoA *soa, u32 offset, u32 count, Ray ray, f32 t_min, f32 t_max, 
+                 f32 *td, f32 *ud, f32 *vd, u32 *hit_index, RayCastStatistics *stats) {
+    stats->ray_triangle_collision_tests += count;
+    bool result = false;
+    
+    lane_f32 ox = lane_set1(ray.orig.x);
+    lane_f32 oy = lane_set1(ray.orig.y);
+    lane_f32 oz = lane_set1(ray.orig.z);
+    lane_f32 dx = lane_set1(ray.dir.x);
+    lane_f32 dy = lane_set1(ray.dir.y);
+    lane_f32 dz = lane_set1(ray.dir.z);
+    lane_f32 zero = lane_set1(0.0f);
+    lane_f32 one = lane_set1(1.0f);
+    for (u32 base = offset;
+         base < offset + count;
+         base += SIMD_LANE_COUNT) {
+        lane_f32 p0x = lane_load(soa->v0[0] + base);
+        lane_f32 p0y = lane_load(soa->v0[1] + base);
+        lane_f32 p0z = lane_load(soa->v0[2] + base);
+        lane_f32 e1x = lane_load(soa->e1[0] + base);
+        lane_f32 e1y = lane_load(soa->e1[1] + base);
+        lane_f32 e1z = lane_load(soa->e1[2] + base);
+        lane_f32 e2x = lane_load(soa->e2[0] + base);
+        lane_f32 e2y = lane_load(soa->e2[1] + base);
+        lane_f32 e2z = lane_load(soa->e2[2] + base);
+        
+        lane_f32 hx = lane_sub(lane_mul(dy, e2z), lane_mul(dz, e2y));
+        lane_f32 hy = lane_sub(lane_mul(dz, e2x), lane_mul(dx, e2z));
+        lane_f32 hz = lane_sub(lane_mul(dx, e2y), lane_mul(dy, e2x));
+        lane_f32 a = lane_add(lane_add(lane_mul(e1x, hx), lane_mul(e1y, hy)), lane_mul(e1z, hz));
+        lane_f32 mask = lane_or(lane_lt(a, lane_set1(-0.001f)), lane_gt(a, lane_set1(0.001f)));
+        
+        lane_f32 f = lane_div(one, a);
+        lane_f32 sx = lane_sub(ox, p0x);
+        lane_f32 sy = lane_sub(oy, p0y);
+        lane_f32 sz = lane_sub(oz, p0z);
+        lane_f32 u = lane_mul(f, lane_add(lane_add(lane_mul(sx, hx), lane_mul(sy, hy)), lane_mul(sz, hz)));
+        lane_f32 qx = lane_sub(lane_mul(sy, e1z), lane_mul(sz, e1y));
+        lane_f32 qy = lane_sub(lane_mul(sz, e1x), lane_mul(sx, e1z));
+        lane_f32 qz = lane_sub(lane_mul(sx, e1y), lane_mul(sy, e1x));
+        lane_f32 v = lane_mul(f, lane_add(lane_add(lane_mul(dx, qx), lane_mul(dy, qy)), lane_mul(dz, qz)));
+        lane_f32 t = lane_mul(f, lane_add(lane_add(lane_mul(e2x, qx), lane_mul(e2y, qy)), lane_mul(e2z, qz)));
+        mask = lane_and(mask, lane_and(lane_gt(u, zero), lane_lt(u, one)));
+        mask = lane_and(mask, lane_and(lane_gt(v, zero), lane_lt(lane_add(u, v), one)));
+        
+        // Lanes past the end of leaf read padding or next leaf triangles, so they are masked out
+        u32 lane_count = offset + count - base;
+        u32 hit_mask = lane_movemask(mask);
+        if (lane_count < SIMD_LANE_COUNT) {
+            hit_mask &= (1 << lane_count) - 1;
+        }
+        if (!hit_mask) {
+            continue;
+        }
+        
+        // Closest hit is picked in lane order, so ties resolve same as in scalar test
+        f32 lane_t[SIMD_LANE_COUNT];
+        f32 lane_u[SIMD_LANE_COUNT];
+        f32 lane_v[SIMD_LANE_COUNT];
+        lane_store(lane_t, t);
+        lane_store(lane_u, u);
+        lane_store(lane_v, v);
+        for (u32 lane_index = 0;
+             lane_index < SIMD_LANE_COUNT;
+             ++lane_index) {
+            if (hit_mask & (1 << lane_index)) {
+                ++stats->ray_triangle_collision_test_succeses;
+                if ((lane_t[lane_index] > t_min) && (lane_t[lane_index] < t_max)) {
+                    t_max = lane_t[lane_index];
+                    *td = lane_t[lane_index];
+                    *ud = lane_u[lane_index];
+                    *vd = lane_v[lane_index];
+                    *hit_index = base + lane_index;
+                    result = true;
+                }
+            }
+        }
+    }
+    
+    return result;
+}
 
-static int 
-bounds3_compare(World *world, ObjectHandle a, ObjectHandle b, u32 axis) {
-    Bounds3 b0 = get_object_bounds(world, a);
-    Bounds3 b1 = get_object_bounds(world, b);
-    return b0.min.e[axis] < b1.min.e[axis];
+// Slab test of axis-aligned box. Finds distance and axis of face ray enters box through,
+// or face it leaves through if entry is not in (t_min, t_max), like for rays starting inside
+static bool 
+box_hit(Bounds3 bounds, Ray ray, f32 t_min, f32 t_max, f32 *t_hit, u32 *hit_axis, bool *is_exit) {
+    bool result = false;
+    
+    f32 t_enter = -INFINITY;
+    f32 t_leave = INFINITY;
+    u32 enter_axis = 0;
+    u32 leave_axis = 0;
+    for (u32 axis = 0;
+         axis < 3;
+         ++axis) {
+        f32 near = ray.dir_is_neg[axis] ? bounds.max.e[axis] : bounds.min.e[axis];
+        f32 far = ray.dir_is_neg[axis] ? bounds.min.e[axis] : bounds.max.e[axis];
+        f32 t_near = (near - ray.orig.e[axis]) * ray.inv_dir.e[axis];
+        f32 t_far = (far - ray.orig.e[axis]) * ray.inv_dir.e[axis];
+        if (t_near > t_enter) {
+            t_enter = t_near;
+            enter_axis = axis;
+        }
+        if (t_far < t_leave) {
+            t_leave = t_far;
+            leave_axis = axis;
+        }
+    }
+    
+    if (t_enter <= t_leave) {
+        if ((t_enter > t_min) && (t_enter < t_max)) {
+            *t_hit = t_enter;
+            *hit_axis = enter_axis;
+            *is_exit = false;
+            result = true;
+        } else if ((t_leave > t_min) && (t_leave < t_max)) {
+            *t_hit = t_leave;
+            *hit_axis = leave_axis;
+            *is_exit = true;
+            result = true;
+        }
+    }
+    
+    return result;
 }
 
-static BOX_COMPARATOR_SIGNATURE(bounds3_compare_x) { return bounds3_compare((World *)w, *((ObjectHandle *)a), *((ObjectHandle *)b), 0); }
-static BOX_COMPARATOR_SIGNATURE(bounds3_compare_y) { return bounds3_compare((World *)w, *((ObjectHandle *)a), *((ObjectHandle *)b), 1); }
-static BOX_COMPARATOR_SIGNATURE(bounds3_compare_z) { return bounds3_compare((World *)w, *((ObjectHandle *)a), *((ObjectHandle *)b), 2); }
+static f32 
+triangle_area(Vec3 p0, Vec3 p1, Vec3 p2) {
+    return 0.5f * length(cross(v3sub(p1, p0), v3sub(p2, p0)));
+}
 
 static Vec3 
 reflect(Vec3 v, Vec3 n) {
@@ -474,6 +622,13 @@ material_emit(World *world, Ray ray, HitRecord hrec, RayCastData data) {
     return result;
 }
 
+static Transform 
+animated_transform_at(Object *obj, f32 time) {
+    f32 t = (time - obj->animated_transform.time[0]) / (obj->animated_transform.time[1] - obj->animated_transform.time[0]);
+    return transform_tr(v3lerp(obj->animated_transform.t[0], obj->animated_transform.t[1], t),
+                        q4lerp(obj->animated_transform.r[0], obj->animated_transform.r[1], t));
+}
+
 Bounds3 
 get_object_bounds(World *world, ObjectHandle obj_handle) {
     Bounds3 result = bounds3empty();
@@ -481,23 +636,34 @@ get_object_bounds(World *world, ObjectHandle obj_handle) {
     Object *obj = get_object(world, obj_handle);
     switch (obj->type) {
         case ObjectType_ObjectList: {
-            if (obj->obj_list.size) {
-                bool is_first_box = true;
+            if (obj->obj_list.bounds_version != world->bounds_version) {
+                Bounds3 bounds = bounds3empty();
                 for (u64 obj_index = 0;
                      obj_index < obj->obj_list.size;
                      ++obj_index) {
                     ObjectHandle test_object = object_list_get(&obj->obj_list, obj_index);
-                    Bounds3 temp_box = get_object_bounds(world, test_object);
-                    result = is_first_box ? temp_box : bounds3_join(result, temp_box);
-                    is_first_box = false;
+                    bounds = bounds3_join(bounds, get_object_bounds(world, test_object));
                 }
+                // Object storage can't move during recursion, so obj is still valid
+                obj->obj_list.bounds = bounds;
+                obj->obj_list.bounds_version = world->bounds_version;
             }
+            result = obj->obj_list.bounds;
         } break;
         case ObjectType_Sphere: {
             Vec3 rv = v3s(obj->sphere.r);
             result.min = v3sub(obj->sphere.p, rv);
             result.max = v3add(obj->sphere.p, rv);
         } break;
+        case ObjectType_Disk: {
+            // Extent of disk along axis is radius scaled by sine of angle between axis and normal
+            Vec3 n = normalize(obj->disk.n);
+            Vec3 extent = v3(obj->disk.r * sqrt32(max32(1.0f - n.x * n.x, 0.0f)),
+                             obj->disk.r * sqrt32(max32(1.0f - n.y * n.y, 0.0f)),
+                             obj->disk.r * sqrt32(max32(1.0f - n.z * n.z, 0.0f)));
+            result.min = v3sub(obj->disk.p, extent);
+            result.max = v3add(obj->disk.p, extent);
+        } break;
         case ObjectType_Triangle: {
             Vec3 epsilon = v3s(0.001f);
             result = bounds3empty();
@@ -508,7 +674,11 @@ get_object_bounds(World *world, ObjectHandle obj_handle) {
             result.max = v3add(result.max, epsilon);
         } break;
         case ObjectType_ConstantMedium: {
-            result = get_object_bounds(world, obj->constant_medium.boundary);
+            if (obj->constant_medium.bounds_version != world->bounds_version) {
+                obj->constant_medium.bounds = get_object_bounds(world, obj->constant_medium.boundary);
+                obj->constant_medium.bounds_version = world->bounds_version;
+            }
+            result = obj->constant_medium.bounds;
         } break;
         case ObjectType_Transform: {
             result = obj->transform.bounds;
@@ -517,7 +687,24 @@ get_object_bounds(World *world, ObjectHandle obj_handle) {
             result = obj->animated_transform.bounds;
         } break;
         case ObjectType_BVH: {
-            result = obj->bvh_node.bounds;
+            if (obj->bvh.tree.node_count) {
+                result = obj->bvh.tree.nodes[0].bounds;
+            }
+        } break;
+        case ObjectType_InstanceBVH: {
+            if (obj->instance_bvh.tree.node_count) {
+                result = obj->instance_bvh.tree.nodes[0].bounds;
+            }
+        } break;
+        case ObjectType_MotionBVH: {
+            for (u32 segment_index = 0;
+                 segment_index < obj->motion_bvh.segment_count;
+                 ++segment_index) {
+                BVH *tree = &obj->motion_bvh.segments[segment_index].tree;
+                if (tree->node_count) {
+                    result = bounds3_join(result, bounds3_join(tree->nodes[0].bounds, tree->end_bounds[0]));
+                }
+            }
         } break;
         case ObjectType_Box: {
             result = obj->box.bounds;
@@ -531,6 +718,19 @@ get_object_bounds(World *world, ObjectHandle obj_handle) {
     return result;
 }
 
+Bounds3 
+get_object_bounds_at_time(World *world, ObjectHandle obj_handle, f32 time) {
+    Bounds3 result;
+    Object *obj = get_object(world, obj_handle);
+    if (obj->type == ObjectType_AnimatedTransform) {
+        Transform transform = animated_transform_at(obj, time);
+        result = transform_bounds(get_object_bounds(world, obj->animated_transform.obj), transform.o2w);
+    } else {
+        result = get_object_bounds(world, obj_handle);
+    }
+    return result;
+}
+
 f32 
 get_object_pdf_value(World *world, ObjectHandle obj_handle, Vec3 orig, Vec3 v,
                      RayCastData data){
@@ -645,6 +845,386 @@ get_object_random(World *world, ObjectHandle obj_handle, Vec3 o, RayCastData dat
     return result;
 }
 
+static void 
+triangle_mesh_set_hit(Object *obj, ObjectHandle obj_handle, Ray ray, u32 triangle_index,
+                      f32 hit_t, f32 hit_u, f32 hit_v, HitRecord *hrec) {
+    u32 hit_vertex_index = triangle_index * 3;
+    hrec->t = hit_t;
+    hrec->p = ray_at(ray, hrec->t);
+    
+#if 1
+    Vec3 n0 = obj->triangle_mesh.n[obj->triangle_mesh.tri_indices[hit_vertex_index]];        
+    Vec3 n1 = obj->triangle_mesh.n[obj->triangle_mesh.tri_indices[hit_vertex_index + 1]];    
+    Vec3 n2 = obj->triangle_mesh.n[obj->triangle_mesh.tri_indices[hit_vertex_index + 2]];    
+    Vec3 outward_normal = normalize(v3add3(v3muls(n0, 1 - hit_u - hit_v),
+                                           v3muls(n1, hit_u),
+                                           v3muls(n2, hit_v)));
+#else 
+    Vec3 p0 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[hit_vertex_index]];        
+    Vec3 p1 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[hit_vertex_index + 1]];        
+    Vec3 p2 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[hit_vertex_index + 2]];    
+    Vec3 outward_normal = normalize(cross(v3sub(p1, p0), v3sub(p2, p0)));
+#endif 
+    hit_set_normal(hrec, outward_normal, ray);
+    Vec2 uv0 = obj->triangle_mesh.uv[obj->triangle_mesh.tri_indices[hit_vertex_index]];        
+    Vec2 uv1 = obj->triangle_mesh.uv[obj->triangle_mesh.tri_indices[hit_vertex_index + 1]];    
+    Vec2 uv2 = obj->triangle_mesh.uv[obj->triangle_mesh.tri_indices[hit_vertex_index + 2]];    
+    Vec2 uv = v2add3(v2muls(uv0, 1 - hit_u - hit_v), v2muls(uv1, hit_u), v2muls(uv2, hit_v));
+    hrec->u = uv.x;
+    hrec->v = uv.y;
+    
+    hrec->mat = obj->triangle_mesh.mat;
+    hrec->obj = obj_handle;
+}
+
+// Transforms ray to object space, so object itself does not need to know about transform
+static bool 
+transformed_object_hit(World *world, Ray ray, ObjectHandle obj_handle, Transform *t, f32 t_min, f32 t_max, 
+                       HitRecord *hrec, RayCastData data) {
+    Vec3 os_orig = mat4x4_mul_vec3(t->w2o, ray.orig);
+    Vec3 os_dir = mat4x4_as_3x3_mul_vec3(t->w2o, ray.dir); 
+    Ray os_ray = make_ray(os_orig, os_dir, ray.time);
+    
+    bool result = object_hit(world, os_ray, obj_handle, t_min, t_max, hrec, data);
+    if (result) {
+        Vec3 ws_p = mat4x4_mul_vec3(t->o2w, hrec->p);
+        Vec3 ws_n = normalize(mat4x4_as_3x3_mul_vec3(t->o2w, hrec->n));
+        
+        hrec->p = ws_p;
+        hit_set_normal(hrec, ws_n, ray);   
+    }
+    return result;
+}
+
+// Closest hit found so far during hierarchy traversal
+typedef struct {
+    bool has_hit;
+    f32 t_max;
+    // Closest hit triangle when traversing mesh
+    u32 triangle_index;
+    f32 u, v;
+    // Objects referenced by leaves and position of ray time in time range when traversing motion hierarchy
+    ObjectHandle *motion_objs;
+    f32 motion_t;
+} BVHHitState;
+
+// Tests nobj primitives of leaf starting from offset. 
+// For ObjectType_BVH, ObjectType_MotionBVH and ObjectType_InstanceBVH hrec is written directly, 
+// for meshes only triangle is remembered
+static void
+bvh_leaf_hit(World *world, Object *obj, ObjectHandle obj_handle, BVH *bvh, Ray ray, f32 t_min, 
+             u32 offset, u32 nobj, BVHHitState *state, HitRecord *hrec, RayCastData data) {
+    switch (obj->type) {
+        case ObjectType_BVH: 
+        case ObjectType_MotionBVH: {
+            ObjectHandle *objs = obj->type == ObjectType_BVH ? obj->bvh.objs : state->motion_objs;
+            for (u32 obj_index = offset;
+                 obj_index < offset + nobj;
+                 ++obj_index) {
+                HitRecord temp_hit;
+                if (object_hit(world, ray, objs[obj_index], t_min, state->t_max, &temp_hit, data)) {
+                    state->has_hit = true;
+                    state->t_max = temp_hit.t;
+                    *hrec = temp_hit;
+                }
+            }
+        } break;
+        case ObjectType_InstanceBVH: {
+            for (u32 instance_index = offset;
+                 instance_index < offset + nobj;
+                 ++instance_index) {
+                ObjectInstance *instance = obj->instance_bvh.instances + instance_index;
+                HitRecord temp_hit;
+                if (transformed_object_hit(world, ray, instance->obj, &instance->t, t_min, state->t_max, &temp_hit, data)) {
+                    state->has_hit = true;
+                    state->t_max = temp_hit.t;
+                    *hrec = temp_hit;
+                    hrec->obj = obj_handle;
+                    if (instance->override_mat) {
+                        hrec->mat = instance->mat;
+                    }
+                }
+            }
+        } break;
+        case ObjectType_TriangleMesh: {
+            f32 t, u, v;
+            u32 prim_index;
+            if (triangle_soa_hit(&obj->triangle_mesh.soa, offset, nobj, ray, t_min, state->t_max, 
+                                 &t, &u, &v, &prim_index, data.stats)) {
+                state->has_hit = true;
+                state->t_max = t;
+                state->u = u;
+                state->v = v;
+                // Vertex arrays are only looked up for closest hit
+                state->triangle_index = bvh->prims[prim_index];
+            }
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+}
+
+// Tests ray against all children of wide node. 
+// Returns mask of hit children and writes entry distances of them to t_near
+static u32 
+bvh_wide_node_hit(BVHWideNode *node, Vec3 orig, Vec3 inv_dir, f32 t_min, f32 t_max, f32 *t_near) {
+    u32 result = 0;
+#if defined(__AVX2__)
+    __m256 ox = _mm256_set1_ps(orig.x);
+    __m256 oy = _mm256_set1_ps(orig.y);
+    __m256 oz = _mm256_set1_ps(orig.z);
+    __m256 idx = _mm256_set1_ps(inv_dir.x);
+    __m256 idy = _mm256_set1_ps(inv_dir.y);
+    __m256 idz = _mm256_set1_ps(inv_dir.z);
+    
+    __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node->min_x), ox), idx);
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node->max_x), ox), idx);
+    __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node->min_y), oy), idy);
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node->max_y), oy), idy);
+    __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node->min_z), oz), idz);
+    __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node->max_z), oz), idz);
+    
+    __m256 enter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+                                 _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_set1_ps(t_min)));
+    __m256 exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+                                _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+    _mm256_storeu_ps(t_near, enter);
+    result = _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+#else 
+    for (u32 child_index = 0;
+         child_index < node->child_count;
+         ++child_index) {
+        f32 tx0 = (node->min_x[child_index] - orig.x) * inv_dir.x;
+        f32 tx1 = (node->max_x[child_index] - orig.x) * inv_dir.x;
+        f32 ty0 = (node->min_y[child_index] - orig.y) * inv_dir.y;
+        f32 ty1 = (node->max_y[child_index] - orig.y) * inv_dir.y;
+        f32 tz0 = (node->min_z[child_index] - orig.z) * inv_dir.z;
+        f32 tz1 = (node->max_z[child_index] - orig.z) * inv_dir.z;
+        
+        f32 enter = max32(max32(min32(tx0, tx1), min32(ty0, ty1)), max32(min32(tz0, tz1), t_min));
+        f32 exit = min32(min32(max32(tx0, tx1), max32(ty0, ty1)), min32(max32(tz0, tz1), t_max));
+        t_near[child_index] = enter;
+        if (enter <= exit) {
+            result |= 1 << child_index;
+        }
+    }
+#endif 
+    return result;
+}
+
+// Builds 2^exponent directly from bits, exponent of quantized node is always in normal float range
+static inline f32 
+bvh_exponent_to_scale(i8 exponent) {
+    u32 bits = (u32)(exponent + 127) << 23;
+    f32 result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// Same as bvh_wide_node_hit, but for quantized node.
+// Ray is moved to node quantization space, so child bounds are decoded with single multiply-add
+static u32 
+bvh_compressed_node_hit(BVHCompressedNode *node, Vec3 orig, Vec3 inv_dir, f32 t_min, f32 t_max, f32 *t_near) {
+    u32 result = 0;
+    Vec3 scale = v3(inv_dir.x * bvh_exponent_to_scale(node->exponent[0]), 
+                    inv_dir.y * bvh_exponent_to_scale(node->exponent[1]), 
+                    inv_dir.z * bvh_exponent_to_scale(node->exponent[2]));
+    Vec3 offset = v3mul(v3sub(node->origin, orig), inv_dir);
+#if defined(__AVX2__)
+#define BVH_LOAD_Q(_q) _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(_q))))
+    __m256 sx = _mm256_set1_ps(scale.x);
+    __m256 sy = _mm256_set1_ps(scale.y);
+    __m256 sz = _mm256_set1_ps(scale.z);
+    __m256 ox = _mm256_set1_ps(offset.x);
+    __m256 oy = _mm256_set1_ps(offset.y);
+    __m256 oz = _mm256_set1_ps(offset.z);
+    
+    __m256 tx0 = _mm256_add_ps(_mm256_mul_ps(BVH_LOAD_Q(node->q_min_x), sx), ox);
+    __m256 tx1 = _mm256_add_ps(_mm256_mul_ps(BVH_LOAD_Q(node->q_max_x), sx), ox);
+    __m256 ty0 = _mm256_add_ps(_mm256_mul_ps(BVH_LOAD_Q(node->q_min_y), sy), oy);
+    __m256 ty1 = _mm256_add_ps(_mm256_mul_ps(BVH_LOAD_Q(node->q_max_y), sy), oy);
+    __m256 tz0 = _mm256_add_ps(_mm256_mul_ps(BVH_LOAD_Q(node->q_min_z), sz), oz);
+    __m256 tz1 = _mm256_add_ps(_mm256_mul_ps(BVH_LOAD_Q(node->q_max_z), sz), oz);
+#undef BVH_LOAD_Q
+    
+    __m256 enter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+                                 _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_set1_ps(t_min)));
+    __m256 exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+                                _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+    _mm256_storeu_ps(t_near, enter);
+    result = _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+#else 
+    for (u32 child_index = 0;
+         child_index < node->child_count;
+         ++child_index) {
+        f32 tx0 = node->q_min_x[child_index] * scale.x + offset.x;
+        f32 tx1 = node->q_max_x[child_index] * scale.x + offset.x;
+        f32 ty0 = node->q_min_y[child_index] * scale.y + offset.y;
+        f32 ty1 = node->q_max_y[child_index] * scale.y + offset.y;
+        f32 tz0 = node->q_min_z[child_index] * scale.z + offset.z;
+        f32 tz1 = node->q_max_z[child_index] * scale.z + offset.z;
+        
+        f32 enter = max32(max32(min32(tx0, tx1), min32(ty0, ty1)), max32(min32(tz0, tz1), t_min));
+        f32 exit = min32(min32(max32(tx0, tx1), max32(ty0, ty1)), min32(max32(tz0, tz1), t_max));
+        t_near[child_index] = enter;
+        if (enter <= exit) {
+            result |= 1 << child_index;
+        }
+    }
+#endif 
+    return result;
+}
+
+CT_ASSERT(BVH_MAX_ENTRY_NODES + BVH_MAX_DEPTH <= BVH_STACK_SIZE);
+
+// Fills stack of binary hierarchy traversal with root or entry nodes, returns stack size.
+// Entry nodes are ordered near-first, so they are pushed in reverse
+static u32 
+bvh_push_start_nodes(BVH *bvh, BVHEntryNodes *entry, u32 *stack) {
+    u32 stack_size = 0;
+    if (entry) {
+        for (u32 entry_index = entry->node_count;
+             entry_index > 0;
+             --entry_index) {
+            stack[stack_size++] = entry->nodes[entry_index - 1];
+        }
+    } else if (bvh->node_count) {
+        stack[stack_size++] = 0;
+    }
+    return stack_size;
+}
+
+// Traverses hierarchy of ObjectType_BVH, ObjectType_MotionBVH, ObjectType_InstanceBVH or ObjectType_TriangleMesh.
+// Leaves of these reference objects, instances or mesh triangles respectively.
+// motion_objs and motion_t are only used with motion hierarchy.
+// If entry is set, binary hierarchy is traversed from its nodes instead of root
+static bool 
+bvh_hit(World *world, Object *obj, ObjectHandle obj_handle, BVH *bvh, Ray ray, f32 t_min, f32 t_max, 
+        HitRecord *hrec, RayCastData data, ObjectHandle *motion_objs, f32 motion_t, BVHEntryNodes *entry) {
+    BVHHitState state = {0};
+    state.t_max = t_max;
+    state.motion_objs = motion_objs;
+    state.motion_t = motion_t;
+    
+    if (bvh->wide_node_count) {
+        assert(!entry);
+        // Stack entries remember entry distance, so nodes farther than closest hit can be skipped
+        u32 stack[BVH_WIDE_STACK_SIZE];
+        f32 stack_t[BVH_WIDE_STACK_SIZE];
+        u32 stack_size = 0;
+        stack[stack_size] = 0;
+        stack_t[stack_size++] = t_min;
+        
+        while (stack_size) {
+            --stack_size;
+            if (stack_t[stack_size] > state.t_max) {
+                continue;
+            }
+            
+            // Both wide layouts share traversal, only child bounds test differs
+            u32 node_index = stack[stack_size];
+            u32 *children;
+            u16 *nobjs;
+            u32 child_count;
+            u32 hit_mask;
+            f32 t_near[BVH_WIDE_WIDTH];
+            if (bvh->compressed_nodes) {
+                BVHCompressedNode *node = bvh->compressed_nodes + node_index;
+                children = node->child;
+                nobjs = node->nobj;
+                child_count = node->child_count;
+                hit_mask = bvh_compressed_node_hit(node, ray.orig, ray.inv_dir, t_min, state.t_max, t_near);
+            } else {
+                BVHWideNode *node = bvh->wide_nodes + node_index;
+                children = node->child;
+                nobjs = node->nobj;
+                child_count = node->child_count;
+                hit_mask = bvh_wide_node_hit(node, ray.orig, ray.inv_dir, t_min, state.t_max, t_near);
+            }
+            ++data.stats->bvh_node_visits;
+            data.stats->bvh_box_tests += child_count;
+            
+            // Sort hit children by entry distance, so nearest ones are visited first
+            u32 order[BVH_WIDE_WIDTH];
+            u32 order_count = 0;
+            for (u32 child_index = 0;
+                 child_index < child_count;
+                 ++child_index) {
+                if (hit_mask & (1 << child_index)) {
+                    u32 insert_index = order_count++;
+                    while (insert_index && t_near[order[insert_index - 1]] > t_near[child_index]) {
+                        order[insert_index] = order[insert_index - 1];
+                        --insert_index;
+                    }
+                    order[insert_index] = child_index;
+                }
+            }
+            
+            // Leaves are tested right away, interior children are pushed farthest first
+            for (u32 order_index = 0;
+                 order_index < order_count;
+                 ++order_index) {
+                u32 child_index = order[order_index];
+                if (nobjs[child_index] && t_near[child_index] <= state.t_max) {
+                    bvh_leaf_hit(world, obj, obj_handle, bvh, ray, t_min, 
+                        children[child_index], nobjs[child_index], &state, hrec, data);
+                }
+            }
+            for (u32 order_index = order_count;
+                 order_index > 0;
+                 --order_index) {
+                u32 child_index = order[order_index - 1];
+                if (!nobjs[child_index]) {
+                    assert(stack_size < BVH_WIDE_STACK_SIZE);
+                    stack[stack_size] = children[child_index];
+                    stack_t[stack_size++] = t_near[child_index];
+                }
+            }
+        }
+    } else {
+        // Nearer child is visited first, so closest hit is found early and boxes of farther nodes,
+        // which are tested against it when popped, are more likely to be missed
+        u32 stack[BVH_STACK_SIZE];
+        u32 stack_size = bvh_push_start_nodes(bvh, entry, stack);
+        
+        while (stack_size) {
+            u32 node_index = stack[--stack_size];
+            BVHNode *node = bvh->nodes + node_index;
+            ++data.stats->bvh_node_visits;
+            ++data.stats->bvh_box_tests;
+            Bounds3 bounds = node->bounds;
+            if (bvh->end_bounds) {
+                Bounds3 end_bounds = bvh->end_bounds[node_index];
+                bounds.min = v3lerp(bounds.min, end_bounds.min, state.motion_t);
+                bounds.max = v3lerp(bounds.max, end_bounds.max, state.motion_t);
+            }
+            if (!bounds3_hit(bounds, ray, t_min, state.t_max)) {
+                continue;
+            }
+            
+            if (node->nobj) {
+                bvh_leaf_hit(world, obj, obj_handle, bvh, ray, t_min, node->obj_offset, node->nobj, &state, hrec, data);
+            } else {
+                assert(stack_size + 2 <= BVH_STACK_SIZE);
+                u32 second_is_near = ray.dir_is_neg[node->split_axis & BVH_SPLIT_AXIS_MASK] ^ 
+                    ((node->split_axis & BVH_SPLIT_AXIS_FLIPPED) != 0);
+                if (second_is_near) {
+                    stack[stack_size++] = node_index + 1;
+                    stack[stack_size++] = node->sec_child_offset;
+                } else {
+                    stack[stack_size++] = node->sec_child_offset;
+                    stack[stack_size++] = node_index + 1;
+                }
+            }
+        }
+    }
+    
+    if (state.has_hit && obj->type == ObjectType_TriangleMesh) {
+        triangle_mesh_set_hit(obj, obj_handle, ray, state.triangle_index, state.t_max, state.u, state.v, hrec);
+    }
+    
+    return state.has_hit;
+}
+
 bool 
 object_hit(World *world, Ray ray, ObjectHandle obj_handle, f32 t_min, f32 t_max,
            HitRecord *hrec, RayCastData data) {
@@ -778,27 +1358,13 @@ object_hit(World *world, Ray ray, ObjectHandle obj_handle, f32 t_min, f32 t_max,
             }
         } break;
         case ObjectType_Transform: {
-            // @TODO something is wrong with hitting instances or bvhs
-            Vec3 os_orig = mat4x4_mul_vec3(obj->transform.t.w2o, ray.orig);
-            Vec3 os_dir = mat4x4_as_3x3_mul_vec3(obj->transform.t.w2o, ray.dir); 
-            Ray os_ray = make_ray(os_orig, os_dir, ray.time);
-        
-            result = object_hit(world, os_ray, obj->transform.obj, t_min, t_max, hrec, data);
+            result = transformed_object_hit(world, ray, obj->transform.obj, &obj->transform.t, t_min, t_max, hrec, data);
             if (result) {
-                Vec3 ws_p = mat4x4_mul_vec3(obj->transform.t.o2w, hrec->p);
-                Vec3 ws_n = normalize(mat4x4_as_3x3_mul_vec3(obj->transform.t.o2w, hrec->n));
-                
                 hrec->obj = obj_handle;
-                hrec->p = ws_p;
-                hit_set_normal(hrec, ws_n, ray);   
             }
         } break;
         case ObjectType_AnimatedTransform: {
-            f32 ray_time = ray.time;
-            f32 time = (ray_time - obj->animated_transform.time[0]) / (obj->animated_transform.time[1] - obj->animated_transform.time[0]);
-            Vec3 t = v3lerp(obj->animated_transform.t[0], obj->animated_transform.t[1], time);
-            Quat4 r = q4lerp(obj->animated_transform.r[0], obj->animated_transform.r[1], time);
-            Transform trans = transform_tr(t, r);
+            Transform trans = animated_transform_at(obj, ray.time);
             
             Vec3 os_orig = mat4x4_mul_vec3(trans.w2o, ray.orig);
             Vec3 os_dir = mat4x4_as_3x3_mul_vec3(trans.w2o, ray.dir); 
@@ -815,77 +1381,276 @@ object_hit(World *world, Ray ray, ObjectHandle obj_handle, f32 t_min, f32 t_max,
             }
         } break;
         case ObjectType_BVH: {
-            if (bounds3_hit(obj->bvh_node.bounds, ray, t_min, t_max)) {
-                bool hit_left = object_hit(world, ray, obj->bvh_node.left, t_min, t_max, hrec, data);
-                bool hit_right = object_hit(world, ray, obj->bvh_node.right, t_min, hit_left ? hrec->t : t_max, hrec, data);
-                result = hit_left || hit_right;
+            result = bvh_hit(world, obj, obj_handle, &obj->bvh.tree, ray, t_min, t_max, hrec, data, 0, 0, 0);
+        } break;
+        case ObjectType_InstanceBVH: {
+            result = bvh_hit(world, obj, obj_handle, &obj->instance_bvh.tree, ray, t_min, t_max, hrec, data, 0, 0, 0);
+        } break;
+        case ObjectType_MotionBVH: {
+            // Rays are expected to have time inside range, but it is clamped so bounds are never extrapolated
+            f32 duration = obj->motion_bvh.time[1] - obj->motion_bvh.time[0];
+            f32 time = duration > 0.0f ? (ray.time - obj->motion_bvh.time[0]) / duration : 0.0f;
+            time = clamp(time, 0.0f, 1.0f) * obj->motion_bvh.segment_count;
+            u32 segment_index = (u32)time;
+            if (segment_index >= obj->motion_bvh.segment_count) {
+                segment_index = obj->motion_bvh.segment_count - 1;
             }
+            MotionBVHSegment *segment = obj->motion_bvh.segments + segment_index;
+            result = bvh_hit(world, obj, obj_handle, &segment->tree, ray, t_min, t_max, hrec, data, 
+                             segment->objs, time - segment_index, 0);
         } break;
         case ObjectType_Box: {
-            result = object_hit(world, ray, obj->box.sides, t_min, t_max, hrec, data);
-            hrec->obj = obj_handle;
+            f32 t;
+            u32 axis;
+            bool is_exit;
+            if (box_hit(obj->box.bounds, ray, t_min, t_max, &t, &axis, &is_exit)) {
+                Bounds3 bounds = obj->box.bounds;
+                // Entry face is the one facing ray, exit face is opposite to it
+                bool is_max_face = ray.dir_is_neg[axis] ^ is_exit;
+                hrec->t = t;
+                hrec->p = ray_at(ray, t);
+                hrec->p.e[axis] = is_max_face ? bounds.max.e[axis] : bounds.min.e[axis];
+                Vec3 outward_normal = v3s(0);
+                outward_normal.e[axis] = is_max_face ? 1.0f : -1.0f;
+                hit_set_normal(hrec, outward_normal, ray);
+                // Face is mapped to whole texture, with u and v along next two axes
+                u32 u_axis = (axis + 1) % 3;
+                u32 v_axis = (axis + 2) % 3;
+                f32 u_size = bounds.max.e[u_axis] - bounds.min.e[u_axis];
+                f32 v_size = bounds.max.e[v_axis] - bounds.min.e[v_axis];
+                hrec->u = u_size > 0 ? (hrec->p.e[u_axis] - bounds.min.e[u_axis]) / u_size : 0;
+                hrec->v = v_size > 0 ? (hrec->p.e[v_axis] - bounds.min.e[v_axis]) / v_size : 0;
+                
+                hrec->mat = obj->box.mat;
+                hrec->obj = obj_handle;
+                result = true;
+            }
         } break;
         case ObjectType_TriangleMesh: {
-            if (!bounds3_hit(obj->triangle_mesh.bounds, ray, t_min, t_max)) {
-                break;
+            result = bvh_hit(world, obj, obj_handle, &obj->triangle_mesh.bvh, ray, t_min, t_max, hrec, data, 0, 0, 0);
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    
+    data.stats->object_collision_test_successes += result;
+    
+    return result;
+}
+
+// Same as transformed_object_hit, but hit is not transformed back since only its existence matters
+static bool 
+transformed_object_occluded(World *world, Ray ray, ObjectHandle obj_handle, Transform *t, f32 t_min, f32 t_max, 
+                            RayCastData data) {
+    Vec3 os_orig = mat4x4_mul_vec3(t->w2o, ray.orig);
+    Vec3 os_dir = mat4x4_as_3x3_mul_vec3(t->w2o, ray.dir); 
+    Ray os_ray = make_ray(os_orig, os_dir, ray.time);
+    return object_occluded(world, os_ray, obj_handle, t_min, t_max, data);
+}
+
+// Same as bvh_leaf_hit, but stops at first primitive hit
+static bool
+bvh_leaf_occluded(World *world, Object *obj, ObjectHandle *motion_objs, Ray ray, f32 t_min, f32 t_max, 
+                  u32 offset, u32 nobj, RayCastData data) {
+    bool result = false;
+    switch (obj->type) {
+        case ObjectType_BVH: 
+        case ObjectType_MotionBVH: {
+            ObjectHandle *objs = obj->type == ObjectType_BVH ? obj->bvh.objs : motion_objs;
+            for (u32 obj_index = offset;
+                 obj_index < offset + nobj && !result;
+                 ++obj_index) {
+                result = object_occluded(world, ray, objs[obj_index], t_min, t_max, data);
             }
+        } break;
+        case ObjectType_InstanceBVH: {
+            for (u32 instance_index = offset;
+                 instance_index < offset + nobj && !result;
+                 ++instance_index) {
+                ObjectInstance *instance = obj->instance_bvh.instances + instance_index;
+                result = transformed_object_occluded(world, ray, instance->obj, &instance->t, t_min, t_max, data);
+            }
+        } break;
+        case ObjectType_TriangleMesh: {
+            f32 t, u, v;
+            u32 prim_index;
+            result = triangle_soa_hit(&obj->triangle_mesh.soa, offset, nobj, ray, t_min, t_max, 
+                                      &t, &u, &v, &prim_index, data.stats);
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+// Same traversal as bvh_hit, but returns as soon as any leaf is hit. 
+// Nodes are not visited in front-to-back order and t_max never shrinks, so children are not sorted
+static bool 
+bvh_occluded(World *world, Object *obj, BVH *bvh, Ray ray, f32 t_min, f32 t_max, 
+             RayCastData data, ObjectHandle *motion_objs, f32 motion_t) {
+    if (bvh->wide_node_count) {
+        u32 stack[BVH_WIDE_STACK_SIZE];
+        u32 stack_size = 0;
+        stack[stack_size++] = 0;
+        
+        while (stack_size) {
+            u32 node_index = stack[--stack_size];
+            u32 *children;
+            u16 *nobjs;
+            u32 child_count;
+            u32 hit_mask;
+            f32 t_near[BVH_WIDE_WIDTH];
+            if (bvh->compressed_nodes) {
+                BVHCompressedNode *node = bvh->compressed_nodes + node_index;
+                children = node->child;
+                nobjs = node->nobj;
+                child_count = node->child_count;
+                hit_mask = bvh_compressed_node_hit(node, ray.orig, ray.inv_dir, t_min, t_max, t_near);
+            } else {
+                BVHWideNode *node = bvh->wide_nodes + node_index;
+                children = node->child;
+                nobjs = node->nobj;
+                child_count = node->child_count;
+                hit_mask = bvh_wide_node_hit(node, ray.orig, ray.inv_dir, t_min, t_max, t_near);
+            }
+            ++data.stats->bvh_node_visits;
+            data.stats->bvh_box_tests += child_count;
             
-            f32 hit_u, hit_v, hit_t;
-            u32 hit_vertex_index = 0;
-            
-            for (u32 triangle_index = 0;
-                 triangle_index < obj->triangle_mesh.ntrig;
-                 ++triangle_index) {
-                u32 vertex_index = triangle_index * 3;
-                Vec3 p0 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[vertex_index]];        
-                Vec3 p1 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[vertex_index + 1]];        
-                Vec3 p2 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[vertex_index + 2]];        
-                f32 t, u, v;
-                if (triangle_hit(p0, p1, p2, ray, &t, &u, &v, data.stats)) {
-                    if ((t > t_min) && (t < t_max)) {
-                        t_max = t;
-                        
-                        hit_u = u;
-                        hit_v = v;
-                        hit_t = t;
-                        
-                        hit_vertex_index = vertex_index;                        
-                        result = true;
+            for (u32 child_index = 0;
+                 child_index < child_count;
+                 ++child_index) {
+                if (!(hit_mask & (1 << child_index))) {
+                    continue;
+                }
+                
+                if (nobjs[child_index]) {
+                    if (bvh_leaf_occluded(world, obj, motion_objs, ray, t_min, t_max, 
+                                          children[child_index], nobjs[child_index], data)) {
+                        return true;
                     }
+                } else {
+                    assert(stack_size < BVH_WIDE_STACK_SIZE);
+                    stack[stack_size++] = children[child_index];
                 }
             }
+        }
+    } else {
+        u32 stack[BVH_STACK_SIZE];
+        u32 stack_size = bvh_push_start_nodes(bvh, 0, stack);
+        
+        while (stack_size) {
+            u32 node_index = stack[--stack_size];
+            BVHNode *node = bvh->nodes + node_index;
+            ++data.stats->bvh_node_visits;
+            ++data.stats->bvh_box_tests;
+            Bounds3 bounds = node->bounds;
+            if (bvh->end_bounds) {
+                Bounds3 end_bounds = bvh->end_bounds[node_index];
+                bounds.min = v3lerp(bounds.min, end_bounds.min, motion_t);
+                bounds.max = v3lerp(bounds.max, end_bounds.max, motion_t);
+            }
+            if (!bounds3_hit(bounds, ray, t_min, t_max)) {
+                continue;
+            }
             
-            if (result) {
-                hrec->t = hit_t;
-                hrec->p = ray_at(ray, hrec->t);
-                
-#if 1
-                Vec3 n0 = obj->triangle_mesh.n[obj->triangle_mesh.tri_indices[hit_vertex_index]];        
-                Vec3 n1 = obj->triangle_mesh.n[obj->triangle_mesh.tri_indices[hit_vertex_index + 1]];    
-                Vec3 n2 = obj->triangle_mesh.n[obj->triangle_mesh.tri_indices[hit_vertex_index + 2]];    
-                Vec3 outward_normal = normalize(v3add3(v3muls(n0, 1 - hit_u - hit_v),
-                                                       v3muls(n1, hit_u),
-                                                       v3muls(n2, hit_v)));
-#else 
-                Vec3 p0 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[hit_vertex_index]];        
-                Vec3 p1 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[hit_vertex_index + 1]];        
-                Vec3 p2 = obj->triangle_mesh.p[obj->triangle_mesh.tri_indices[hit_vertex_index + 2]];    
-                Vec3 outward_normal = normalize(cross(v3sub(p1, p0), v3sub(p2, p0)));
-#endif 
-                // hrec->n = outward_normal;
-                // hrec->is_front_face = true;
-                hit_set_normal(hrec, outward_normal, ray);
-                Vec2 uv0 = obj->triangle_mesh.uv[obj->triangle_mesh.tri_indices[hit_vertex_index]];        
-                Vec2 uv1 = obj->triangle_mesh.uv[obj->triangle_mesh.tri_indices[hit_vertex_index + 1]];    
-                Vec2 uv2 = obj->triangle_mesh.uv[obj->triangle_mesh.tri_indices[hit_vertex_index + 2]];    
-                Vec2 uv = v2add3(v2muls(uv0, 1 - hit_u - hit_v), v2muls(uv1, hit_u), v2muls(uv2, hit_v));
-                hrec->u = uv.x;
-                hrec->v = uv.y;
-                
-                hrec->mat = obj->triangle_mesh.mat;
-                hrec->obj = obj_handle;
+            if (node->nobj) {
+                if (bvh_leaf_occluded(world, obj, motion_objs, ray, t_min, t_max, node->obj_offset, node->nobj, data)) {
+                    return true;
+                }
+            } else {
+                assert(stack_size + 2 <= BVH_STACK_SIZE);
+                stack[stack_size++] = node->sec_child_offset;
+                stack[stack_size++] = node_index + 1;
+            }
+        }
+    }
+    
+    return false;
+}
+
+bool 
+object_occluded(World *world, Ray ray, ObjectHandle obj_handle, f32 t_min, f32 t_max, RayCastData data) {
+    bool result = false;
+    
+    ++data.stats->object_collision_tests;
+    
+    Object *obj = get_object(world, obj_handle);
+    switch(obj->type) {
+        case ObjectType_Sphere: {
+            Vec3 rel_orig = v3sub(ray.orig, obj->sphere.p);
+            f32 a = length_sq(ray.dir);
+            f32 half_b = dot(rel_orig, ray.dir);
+            f32 c = length_sq(rel_orig) - obj->sphere.r * obj->sphere.r;
+            f32 discriminant = half_b * half_b - a * c;
+            if (discriminant >= 0) {
+                f32 root_term = sqrt32(discriminant);
+                f32 tp = (-half_b + root_term) / a;
+                f32 tn = (-half_b - root_term) / a;
+                result = ((tn > t_min) && (tn < t_max)) || ((tp > t_min) && (tp < t_max));
+            }
+        } break;
+        case ObjectType_Disk: {
+            f32 d = dot(obj->disk.n, ray.dir);
+            if ((d < -0.001f) || (d > 0.001f)) {
+                Vec3 ro = v3sub(obj->disk.p, ray.orig); 
+                f32 t = dot(ro, obj->disk.n) / d;
+                f32 dtcsq = length_sq(v3sub(ray_at(ray, t), obj->disk.p));
+                result = (t > t_min) && (t < t_max) && (dtcsq < obj->disk.r * obj->disk.r);
+            }
+        } break;
+        case ObjectType_Triangle: {
+            ++data.stats->ray_triangle_collision_tests;
+            
+            f32 t, u, v;
+            if (triangle_hit(obj->triangle.p[0], obj->triangle.p[1], obj->triangle.p[2], ray, 
+                             &t, &u, &v, data.stats)) {
+                result = (t > t_min) && (t < t_max);
+            }
+        } break;
+        case ObjectType_ObjectList: {
+            for (u64 obj_index = 0;
+                 obj_index < obj->obj_list.size && !result;
+                 ++obj_index) {
+                result = object_occluded(world, ray, object_list_get(&obj->obj_list, obj_index), t_min, t_max, data);
             }
         } break;
+        case ObjectType_ConstantMedium: {
+            // Medium is hit at random distance, which is sampled same way as for closest hit
+            HitRecord hrec;
+            result = object_hit(world, ray, obj_handle, t_min, t_max, &hrec, data);
+        } break;
+        case ObjectType_Transform: {
+            result = transformed_object_occluded(world, ray, obj->transform.obj, &obj->transform.t, t_min, t_max, data);
+        } break;
+        case ObjectType_AnimatedTransform: {
+            Transform trans = animated_transform_at(obj, ray.time);
+            result = transformed_object_occluded(world, ray, obj->animated_transform.obj, &trans, t_min, t_max, data);
+        } break;
+        case ObjectType_BVH: {
+            result = bvh_occluded(world, obj, &obj->bvh.tree, ray, t_min, t_max, data, 0, 0);
+        } break;
+        case ObjectType_InstanceBVH: {
+            result = bvh_occluded(world, obj, &obj->instance_bvh.tree, ray, t_min, t_max, data, 0, 0);
+        } break;
+        case ObjectType_MotionBVH: {
+            f32 duration = obj->motion_bvh.time[1] - obj->motion_bvh.time[0];
+            f32 time = duration > 0.0f ? (ray.time - obj->motion_bvh.time[0]) / duration : 0.0f;
+            time = clamp(time, 0.0f, 1.0f) * obj->motion_bvh.segment_count;
+            u32 segment_index = (u32)time;
+            if (segment_index >= obj->motion_bvh.segment_count) {
+                segment_index = obj->motion_bvh.segment_count - 1;
+            }
+            MotionBVHSegment *segment = obj->motion_bvh.segments + segment_index;
+            result = bvh_occluded(world, obj, &segment->tree, ray, t_min, t_max, data, 
+                                  segment->objs, time - segment_index);
+        } break;
+        case ObjectType_Box: {
+            f32 t;
+            u32 axis;
+            bool is_exit;
+            result = box_hit(obj->box.bounds, ray, t_min, t_max, &t, &axis, &is_exit);
+        } break;
+        case ObjectType_TriangleMesh: {
+            result = bvh_occluded(world, obj, &obj->triangle_mesh.bvh, ray, t_min, t_max, data, 0, 0);
+        } break;
         INVALID_DEFAULT_CASE;
     }
     
@@ -894,80 +1659,452 @@ object_hit(World *world, Ray ray, ObjectHandle obj_handle, f32 t_min, f32 t_max,
     return result;
 }
 
-Vec3 
-ray_cast(World *world, Ray ray, i32 depth, RayCastData data) {
-    Vec3 radiance = v3s(0);
-    Vec3 throughput = v3s(1.0);
-    
-    for(u32 bounce = 0;
-        bounce < depth;
-        ++bounce) {
-        ++data.stats->bounce_count;
+bool 
+world_occluded(World *world, Ray ray, f32 t_max, RayCastData data) {
+    return object_occluded(world, ray, world->obj_list, DISTANCE_EPSILON, t_max, data);
+}
+
+// Rays traced together, with components split to arrays for SIMD tests
+typedef struct {
+    // Rounded up to SIMD lane count
+    u32 ray_count;
+    f32 orig[3][RAY_PACKET_MAX_SIZE];
+    f32 inv_dir[3][RAY_PACKET_MAX_SIZE];
+    // Closest hit distance so far
+    f32 t_max[RAY_PACKET_MAX_SIZE];
+} RayPacket;
+
+// Tests bounds of node against all rays of packet, stored per component.
+// Returns mask of rays which hit node
+static u32 
+ray_packet_node_hit(RayPacket *packet, Bounds3 bounds) {
+    u32 result = 0;
+    lane_f32 min_x = lane_set1(bounds.min.x);
+    lane_f32 min_y = lane_set1(bounds.min.y);
+    lane_f32 min_z = lane_set1(bounds.min.z);
+    lane_f32 max_x = lane_set1(bounds.max.x);
+    lane_f32 max_y = lane_set1(bounds.max.y);
+    lane_f32 max_z = lane_set1(bounds.max.z);
+    lane_f32 t_min = lane_set1(DISTANCE_EPSILON);
+    for (u32 base = 0;
+         base < packet->ray_count;
+         base += SIMD_LANE_COUNT) {
+        lane_f32 ox = lane_load(packet->orig[0] + base);
+        lane_f32 oy = lane_load(packet->orig[1] + base);
+        lane_f32 oz = lane_load(packet->orig[2] + base);
+        lane_f32 idx = lane_load(packet->inv_dir[0] + base);
+        lane_f32 idy = lane_load(packet->inv_dir[1] + base);
+        lane_f32 idz = lane_load(packet->inv_dir[2] + base);
         
-        HitRecord hrec = {0};
-        if (!object_hit(world, ray, world->obj_list, DISTANCE_EPSILON, INFINITY, &hrec, data)) {
-            radiance = v3add(radiance, v3mul(throughput, world->backgorund_color));
-            break;
-        }    
+        lane_f32 tx0 = lane_mul(lane_sub(min_x, ox), idx);
+        lane_f32 tx1 = lane_mul(lane_sub(max_x, ox), idx);
+        lane_f32 ty0 = lane_mul(lane_sub(min_y, oy), idy);
+        lane_f32 ty1 = lane_mul(lane_sub(max_y, oy), idy);
+        lane_f32 tz0 = lane_mul(lane_sub(min_z, oz), idz);
+        lane_f32 tz1 = lane_mul(lane_sub(max_z, oz), idz);
         
-        Vec3 emitted = material_emit(world, ray, hrec, data);
-        if (length_sq(emitted) > 0) {
-            radiance = v3add(radiance, v3mul(throughput, emitted));
+        lane_f32 enter = lane_max(lane_max(lane_min(tx0, tx1), lane_min(ty0, ty1)), lane_max(lane_min(tz0, tz1), t_min));
+        lane_f32 exit = lane_min(lane_min(lane_max(tx0, tx1), lane_max(ty0, ty1)), 
+                                 lane_min(lane_max(tz0, tz1), lane_load(packet->t_max + base)));
+        result |= lane_movemask(lane_le(enter, exit)) << base;
+    }
+    return result;
+}
+
+// Hierarchies packets can traverse together: binary ones over objects or mesh triangles
+static BVH *
+ray_packet_get_bvh(Object *obj) {
+    BVH *result = 0;
+    if (obj->type == ObjectType_BVH) {
+        result = &obj->bvh.tree;
+    } else if (obj->type == ObjectType_TriangleMesh) {
+        result = &obj->triangle_mesh.bvh;
+    }
+    if (result && (!result->node_count || result->wide_node_count)) {
+        result = 0;
+    }
+    return result;
+}
+
+// Works like object_hit called for every ray of packet with interval (DISTANCE_EPSILON, t_max[ray_index]).
+// For rays which hit object has_hit, t_max and hrecs are updated, others are left untouched
+static void 
+ray_packet_object_hit(World *world, ObjectHandle obj_handle, u32 ray_count, Ray *rays, f32 *t_max, 
+                      bool *has_hit, HitRecord *hrecs, RayCastData data, BVHEntryNodes *entry) {
+    Object *obj = get_object(world, obj_handle);
+    if (obj->type == ObjectType_ObjectList) {
+        data.stats->object_collision_tests += ray_count;
+        for (u32 obj_index = 0;
+             obj_index < obj->obj_list.size;
+             ++obj_index) {
+            ray_packet_object_hit(world, object_list_get(&obj->obj_list, obj_index), ray_count, rays, t_max, 
+                                  has_hit, hrecs, data, 0);
         }
-        
-        ScatterRecord srec = {0};
-        if (!material_scatter(world, ray, hrec, data, &srec)) {
-            break;
+        return;
+    }
+    
+    if (obj->type == ObjectType_Transform) {
+        // All rays are moved to object space, so hierarchies under transform are traversed by packet too.
+        // Directions are not normalized, so hit distances are the same in both spaces
+        data.stats->object_collision_tests += ray_count;
+        Transform *t = &obj->transform.t;
+        Ray os_rays[RAY_PACKET_MAX_SIZE];
+        bool os_has_hit[RAY_PACKET_MAX_SIZE] = {0};
+        HitRecord os_hrecs[RAY_PACKET_MAX_SIZE];
+        for (u32 ray_index = 0;
+             ray_index < ray_count;
+             ++ray_index) {
+            Vec3 os_orig = mat4x4_mul_vec3(t->w2o, rays[ray_index].orig);
+            Vec3 os_dir = mat4x4_as_3x3_mul_vec3(t->w2o, rays[ray_index].dir); 
+            os_rays[ray_index] = make_ray(os_orig, os_dir, rays[ray_index].time);
         }
-        if (!material_compute_scattering_functions(world, ray.dir, hrec.n, hrec, &srec, data)) {
-            break;
+        ray_packet_object_hit(world, obj->transform.obj, ray_count, os_rays, t_max, os_has_hit, os_hrecs, data, 0);
+        for (u32 ray_index = 0;
+             ray_index < ray_count;
+             ++ray_index) {
+            if (os_has_hit[ray_index]) {
+                HitRecord *hrec = hrecs + ray_index;
+                *hrec = os_hrecs[ray_index];
+                Vec3 ws_p = mat4x4_mul_vec3(t->o2w, hrec->p);
+                Vec3 ws_n = normalize(mat4x4_as_3x3_mul_vec3(t->o2w, hrec->n));
+                hrec->p = ws_p;
+                hit_set_normal(hrec, ws_n, rays[ray_index]);   
+                hrec->obj = obj_handle;
+                has_hit[ray_index] = true;
+                ++data.stats->object_collision_test_successes;
+            }
+        }
+        return;
+    }
+    
+    BVH *bvh = ray_packet_get_bvh(obj);
+    if (!bvh) {
+        for (u32 ray_index = 0;
+             ray_index < ray_count;
+             ++ray_index) {
+            HitRecord temp_hit;
+            if (object_hit(world, rays[ray_index], obj_handle, DISTANCE_EPSILON, t_max[ray_index], &temp_hit, data)) {
+                has_hit[ray_index] = true;
+                t_max[ray_index] = temp_hit.t;
+                hrecs[ray_index] = temp_hit;
+            }
+        }
+        return;
+    }
+    data.stats->object_collision_tests += ray_count;
+    
+    // Lanes past ray_count are padding with empty interval, so they never hit anything
+    RayPacket packet = {0};
+    packet.ray_count = (ray_count + SIMD_LANE_COUNT - 1) / SIMD_LANE_COUNT * SIMD_LANE_COUNT;
+    BVHHitState states[RAY_PACKET_MAX_SIZE] = {0};
+    for (u32 ray_index = 0;
+         ray_index < packet.ray_count;
+         ++ray_index) {
+        if (ray_index < ray_count) {
+            for (u32 axis = 0;
+                 axis < 3;
+                 ++axis) {
+                packet.orig[axis][ray_index] = rays[ray_index].orig.e[axis];
+                packet.inv_dir[axis][ray_index] = rays[ray_index].inv_dir.e[axis];
+            }
+            packet.t_max[ray_index] = t_max[ray_index];
+            states[ray_index].t_max = t_max[ray_index];
+        } else {
+            packet.t_max[ray_index] = -INFINITY;
+        }
+    }
+    
+    // Same near-first order as single ray traversal, but it is chosen by the first ray.
+    // Packets are made of neighbouring camera rays, so their directions mostly agree
+    u32 stack[BVH_STACK_SIZE];
+    u32 stack_size = bvh_push_start_nodes(bvh, entry, stack);
+    while (stack_size) {
+        u32 node_index = stack[--stack_size];
+        BVHNode *node = bvh->nodes + node_index;
+        ++data.stats->bvh_node_visits;
+        data.stats->bvh_box_tests += ray_count;
+        u32 hit_mask = ray_packet_node_hit(&packet, node->bounds);
+        if (!hit_mask) {
+            continue;
         }
         
-        // if (get_material(world, hrec.mat)->type == MaterialType_Lambertian) {
-            // Vec3 dir;
-            // if (randomu(data.entropy) < 0.5) {
-            //     dir = normalize(get_object_random(world, world->important_objects, hrec.p, data));    
-            // } else {
-            //     dir = srec.dir;
-            // }
+        if (node->nobj && obj->type == ObjectType_TriangleMesh) {
+            for (u32 ray_index = 0;
+                 ray_index < ray_count;
+                 ++ray_index) {
+                f32 t, u, v;
+                u32 prim_index;
+                BVHHitState *state = states + ray_index;
+                if ((hit_mask & (1 << ray_index)) && 
+                    triangle_soa_hit(&obj->triangle_mesh.soa, node->obj_offset, node->nobj, rays[ray_index], 
+                                     DISTANCE_EPSILON, state->t_max, &t, &u, &v, &prim_index, data.stats)) {
+                    state->has_hit = true;
+                    state->t_max = t;
+                    state->u = u;
+                    state->v = v;
+                    state->triangle_index = bvh->prims[prim_index];
+                    packet.t_max[ray_index] = t;
+                }
+            }
+        } else if (node->nobj) {
+            // Leaf objects are tested with rays which hit leaf, they are gathered to smaller packet, 
+            // so nested hierarchies are traversed by packets too
+            u32 sub_ray_indices[RAY_PACKET_MAX_SIZE];
+            Ray sub_rays[RAY_PACKET_MAX_SIZE];
+            u32 sub_ray_count = 0;
+            for (u32 ray_index = 0;
+                 ray_index < ray_count;
+                 ++ray_index) {
+                if (hit_mask & (1 << ray_index)) {
+                    sub_ray_indices[sub_ray_count] = ray_index;
+                    sub_rays[sub_ray_count++] = rays[ray_index];
+                }
+            }
             
-            // srec.dir = dir;    
-            // f32 light_pdf = get_object_pdf_value(world, world->important_objects, hrec.p, dir, data);
-            // f32 pdf = 0.5f * srec.pdf + 0.5f * light_pdf;
-            // srec.weight = v3divs(srec.bsdf, pdf);
+            for (u32 obj_index = node->obj_offset;
+                 obj_index < node->obj_offset + node->nobj;
+                 ++obj_index) {
+                f32 sub_t_max[RAY_PACKET_MAX_SIZE];
+                bool sub_has_hit[RAY_PACKET_MAX_SIZE] = {0};
+                HitRecord sub_hrecs[RAY_PACKET_MAX_SIZE];
+                for (u32 sub_ray_index = 0;
+                     sub_ray_index < sub_ray_count;
+                     ++sub_ray_index) {
+                    sub_t_max[sub_ray_index] = states[sub_ray_indices[sub_ray_index]].t_max;
+                }
+                ray_packet_object_hit(world, obj->bvh.objs[obj_index], sub_ray_count, sub_rays, sub_t_max, 
+                                      sub_has_hit, sub_hrecs, data, 0);
+                for (u32 sub_ray_index = 0;
+                     sub_ray_index < sub_ray_count;
+                     ++sub_ray_index) {
+                    if (sub_has_hit[sub_ray_index]) {
+                        u32 ray_index = sub_ray_indices[sub_ray_index];
+                        states[ray_index].has_hit = true;
+                        states[ray_index].t_max = sub_t_max[sub_ray_index];
+                        packet.t_max[ray_index] = sub_t_max[sub_ray_index];
+                        hrecs[ray_index] = sub_hrecs[sub_ray_index];
+                    }
+                }
+            }
+        } else {
+            assert(stack_size + 2 <= BVH_STACK_SIZE);
+            u32 second_is_near = rays[0].dir_is_neg[node->split_axis & BVH_SPLIT_AXIS_MASK] ^ 
+                ((node->split_axis & BVH_SPLIT_AXIS_FLIPPED) != 0);
+            if (second_is_near) {
+                stack[stack_size++] = node_index + 1;
+                stack[stack_size++] = node->sec_child_offset;
+            } else {
+                stack[stack_size++] = node->sec_child_offset;
+                stack[stack_size++] = node_index + 1;
+            }
+        }
+    }
+    
+    for (u32 ray_index = 0;
+         ray_index < ray_count;
+         ++ray_index) {
+        BVHHitState *state = states + ray_index;
+        if (state->has_hit) {
+            ++data.stats->object_collision_test_successes;
+            has_hit[ray_index] = true;
+            t_max[ray_index] = state->t_max;
+            if (obj->type == ObjectType_TriangleMesh) {
+                triangle_mesh_set_hit(obj, obj_handle, rays[ray_index], state->triangle_index, state->t_max, 
+                                      state->u, state->v, hrecs + ray_index);
+            }
+        }
+    }
+}
+
+void 
+ray_packet_hit(World *world, u32 ray_count, Ray *rays, bool *has_hit, HitRecord *hrecs, RayCastData data,
+               BVHEntryNodes *entry) {
+    assert(ray_count <= RAY_PACKET_MAX_SIZE);
+    f32 t_max[RAY_PACKET_MAX_SIZE];
+    for (u32 ray_index = 0;
+         ray_index < ray_count;
+         ++ray_index) {
+        t_max[ray_index] = INFINITY;
+        has_hit[ray_index] = false;
+    }
+    ray_packet_object_hit(world, world->obj_list, ray_count, rays, t_max, has_hit, hrecs, data, entry);
+}
+
+bool 
+world_camera_ray_hit(World *world, Ray ray, BVHEntryNodes *entry, HitRecord *hrec, RayCastData data) {
+    bool result;
+    if (entry) {
+        Object *obj = get_object(world, world->obj_list);
+        assert(obj->type == ObjectType_BVH);
+        ++data.stats->object_collision_tests;
+        result = bvh_hit(world, obj, world->obj_list, &obj->bvh.tree, ray, DISTANCE_EPSILON, INFINITY, hrec, data, 0, 0, entry);
+        data.stats->object_collision_test_successes += result;
+    } else {
+        result = object_hit(world, ray, world->obj_list, DISTANCE_EPSILON, INFINITY, hrec, data);
+    }
+    return result;
+}
+
+bool 
+world_frustum_entry_nodes(World *world, Frustum *frustum, BVHEntryNodes *entry) {
+    Object *obj = get_object(world, world->obj_list);
+    if (obj->type != ObjectType_BVH || obj->bvh.tree.wide_node_count || !obj->bvh.tree.node_count) {
+        return false;
+    }
+    
+    BVH *bvh = &obj->bvh.tree;
+    entry->node_count = 0;
+    if (frustum_test_bounds(frustum, bvh->nodes[0].bounds) != FrustumTest_Outside) {
+        entry->nodes[entry->node_count++] = 0;
+    }
+    
+    // Nodes partially inside frustum are replaced by their children which are not outside, while there is space.
+    // Children are kept in place of parent in near-first order for ray through tile center, 
+    // so list stays in order of traversal
+    Vec3 view_dir = frustum->view_dir;
+    u32 dir_is_neg[3] = { view_dir.x < 0.0f, view_dir.y < 0.0f, view_dir.z < 0.0f };
+    bool has_changed = true;
+    while (has_changed) {
+        has_changed = false;
+        for (u32 entry_index = 0;
+             entry_index < entry->node_count;
+             ++entry_index) {
+            u32 node_index = entry->nodes[entry_index];
+            BVHNode *node = bvh->nodes + node_index;
+            if (node->nobj || frustum_test_bounds(frustum, node->bounds) == FrustumTest_Inside) {
+                continue;
+            }
             
-        //     Vec3 dir = normalize(get_object_random(world, world->important_objects, hrec.p, data));    
-        //     f32 light_pdf = get_object_pdf_value(world, world->important_objects, hrec.p, dir, data);
-        //     srec.weight = v3divs(srec.bsdf, light_pdf);
-        // }
-        
+            u32 children[2] = { node_index + 1, node->sec_child_offset };
+            if (dir_is_neg[node->split_axis & BVH_SPLIT_AXIS_MASK] ^ ((node->split_axis & BVH_SPLIT_AXIS_FLIPPED) != 0)) {
+                children[0] = node->sec_child_offset;
+                children[1] = node_index + 1;
+            }
+            u32 kept[2];
+            u32 kept_count = 0;
+            for (u32 child_index = 0;
+                 child_index < 2;
+                 ++child_index) {
+                if (frustum_test_bounds(frustum, bvh->nodes[children[child_index]].bounds) != FrustumTest_Outside) {
+                    kept[kept_count++] = children[child_index];
+                }
+            }
+            if (entry->node_count - 1 + kept_count > BVH_MAX_ENTRY_NODES) {
+                continue;
+            }
+            
+            memmove(entry->nodes + entry_index + kept_count, entry->nodes + entry_index + 1, 
+                    sizeof(u32) * (entry->node_count - entry_index - 1));
+            for (u32 kept_index = 0;
+                 kept_index < kept_count;
+                 ++kept_index) {
+                entry->nodes[entry_index + kept_index] = kept[kept_index];
+            }
+            entry->node_count = entry->node_count - 1 + kept_count;
+            // Kept children are tested again on next pass
+            entry_index = entry_index + kept_count - 1;
+            has_changed = true;
+        }
+    }
+    return true;
+}
+
+Vec3 
+ray_cast(World *world, Ray ray, i32 depth, RayCastData data) {
+    HitRecord hrec = {0};
+    bool has_hit = false;
+    if (depth > 0) {
+        has_hit = object_hit(world, ray, world->obj_list, DISTANCE_EPSILON, INFINITY, &hrec, data);
+    }
+    return ray_cast_from_hit(world, ray, has_hit, hrec, depth, data);
+}
+
+bool 
+path_shade_hit(World *world, Ray *ray, HitRecord *hrec, u32 bounce, Vec3 *throughput, Vec3 *radiance, RayCastData data) {
+    Vec3 emitted = material_emit(world, *ray, *hrec, data);
+    if (length_sq(emitted) > 0) {
+        *radiance = v3add(*radiance, v3mul(*throughput, emitted));
+    }
+    
+    ScatterRecord srec = {0};
+    if (!material_scatter(world, *ray, *hrec, data, &srec)) {
+        return false;
+    }
+    if (!material_compute_scattering_functions(world, ray->dir, hrec->n, *hrec, &srec, data)) {
+        return false;
+    }
+    
+    // if (get_material(world, hrec.mat)->type == MaterialType_Lambertian) {
+        // Vec3 dir;
         // if (randomu(data.entropy) < 0.5) {
-        //     srec.dir = normalize(get_object_random(world, world->important_objects, hrec.p, data));    
+        //     dir = normalize(get_object_random(world, world->important_objects, hrec.p, data));    
+        // } else {
+        //     dir = srec.dir;
         // }
-        // f32 light_pdf = get_object_pdf_value(world, world->important_objects, hrec.p, srec.dir, data);
-        // f32 pdf = 0.5f * light_pdf + srec.pdf * 0.5f;
-        // srec.weight = v3divs(srec.bsdf, pdf);
         
-        // srec.weight = v3divs(srec.bsdf, srec.pdf);
-       
+        // srec.dir = dir;    
+        // f32 light_pdf = get_object_pdf_value(world, world->important_objects, hrec.p, dir, data);
+        // f32 pdf = 0.5f * srec.pdf + 0.5f * light_pdf;
+        // srec.weight = v3divs(srec.bsdf, pdf);
         
-        if (is_black(srec.weight)) {
-            break;
+    //     Vec3 dir = normalize(get_object_random(world, world->important_objects, hrec.p, data));    
+    //     f32 light_pdf = get_object_pdf_value(world, world->important_objects, hrec.p, dir, data);
+    //     srec.weight = v3divs(srec.bsdf, light_pdf);
+    // }
+    
+    // if (randomu(data.entropy) < 0.5) {
+    //     srec.dir = normalize(get_object_random(world, world->important_objects, hrec.p, data));    
+    // }
+    // f32 light_pdf = get_object_pdf_value(world, world->important_objects, hrec.p, srec.dir, data);
+    // f32 pdf = 0.5f * light_pdf + srec.pdf * 0.5f;
+    // srec.weight = v3divs(srec.bsdf, pdf);
+    
+    // srec.weight = v3divs(srec.bsdf, srec.pdf);
+   
+    
+    if (is_black(srec.weight)) {
+        return false;
+    }
+    
+    *throughput = v3mul(*throughput, srec.weight);
+    *ray = make_ray(hrec->p, srec.dir, ray->time);
+    
+#if ENABLE_RUSSIAN_ROULETTE
+    if (bounce > 3) {
+        f32 p = max32(max32(throughput->x, throughput->y), throughput->z);
+        if (randomu(data.entropy) > min32(p, 0.95f)) {
+            ++data.stats->russian_roulette_terminated_bounces;
+            return false;
         }
+        *throughput = v3muls(*throughput, 1.0f / p);
+    }
+#endif 
+    
+    return true;
+}
+
+Vec3 
+ray_cast_from_hit(World *world, Ray ray, bool has_hit, HitRecord hrec, i32 depth, RayCastData data) {
+    Vec3 radiance = v3s(0);
+    Vec3 throughput = v3s(1.0);
+    
+    for(u32 bounce = 0;
+        bounce < depth;
+        ++bounce) {
+        ++data.stats->bounce_count;
         
-        throughput = v3mul(throughput, srec.weight);
-        ray = make_ray(hrec.p, srec.dir, ray.time);
+        if (bounce) {
+            hrec = (HitRecord) {0};
+            has_hit = object_hit(world, ray, world->obj_list, DISTANCE_EPSILON, INFINITY, &hrec, data);
+        }
+        if (!has_hit) {
+            radiance = v3add(radiance, v3mul(throughput, world->backgorund_color));
+            break;
+        }    
         
-#if ENABLE_RUSSIAN_ROULETTE
-        if (bounce > 3) {
-            f32 p = max32(max32(throughput.x, throughput.y), throughput.z);
-            if (randomu(data.entropy) > min32(p, 0.95f)) {
-                ++data.stats->russian_roulette_terminated_bounces;
-                break;
-            }
-            throughput = v3muls(throughput, 1.0f / p);
+        if (!path_shade_hit(world, &ray, &hrec, bounce, &throughput, &radiance, data)) {
+            break;
         }
-#endif 
     }
     
     return radiance;
@@ -15,6 +15,9 @@ typedef struct {
     u64 object_collision_tests;
     u64 object_collision_test_successes;
     u64 russian_roulette_terminated_bounces;
+    // Nodes popped from traversal stack and child bounds tested in them
+    u64 bvh_node_visits;
+    u64 bvh_box_tests;
 } RayCastStatistics;
 
 typedef struct {
@@ -61,12 +64,54 @@ typedef struct {
 // Called from multiple threads, so everything should be thread-safe.
 // Returns color of casted ray.
 Vec3 ray_cast(World *world, Ray ray, i32 depth, RayCastData data);
+// Same as ray_cast, but closest hit of ray from world root is already found
+Vec3 ray_cast_from_hit(World *world, Ray ray, bool has_hit, HitRecord hrec, i32 depth, RayCastData data);
+// Bounce of path at hit: adds emission to radiance, scatters ray and updates throughput.
+// Returns false if path ends at this hit
+bool path_shade_hit(World *world, Ray *ray, HitRecord *hrec, u32 bounce, Vec3 *throughput, Vec3 *radiance, RayCastData data);
+
+// Samples with infinite or NaN components would spoil whole pixel, so such components are dropped
+static inline Vec3 
+sample_color_remove_nans(Vec3 sample_color) {
+    if (!isfinite(sample_color.r)) { sample_color.r = 0; }
+    if (!isfinite(sample_color.g)) { sample_color.g = 0; }
+    if (!isfinite(sample_color.b)) { sample_color.b = 0; }
+    return sample_color;
+}
+
+#define RAY_PACKET_MAX_SIZE 16
+
+// Nodes of world root hierarchy which camera rays of one image tile start traversal from.
+// Nodes outside of tile frustum are culled once per tile instead of being tested by every ray
+#define BVH_MAX_ENTRY_NODES 32
+typedef struct {
+    u32 node_count;
+    u32 nodes[BVH_MAX_ENTRY_NODES];
+} BVHEntryNodes;
+
+// Returns false if world root is not binary hierarchy, then camera rays are traced from root as usual.
+bool world_frustum_entry_nodes(World *world, Frustum *frustum, BVHEntryNodes *entry);
+// Closest hit of camera ray from world root. If entry is set, root hierarchy is traversed from its nodes
+bool world_camera_ray_hit(World *world, Ray ray, BVHEntryNodes *entry, HitRecord *hrec, RayCastData data);
+// Finds closest hits of up to RAY_PACKET_MAX_SIZE rays from world root, writing them to hrecs.
+// Binary hierarchies over objects and mesh triangles are traversed by whole packet: each node is fetched once 
+// and its bounds are tested against all rays at once. Other objects are tested by rays one by one.
+// If entry is set, root hierarchy is traversed from its nodes
+void ray_packet_hit(World *world, u32 ray_count, Ray *rays, bool *has_hit, HitRecord *hrecs, RayCastData data,
+                    BVHEntryNodes *entry);
 
 Vec3 sample_texture(World *world, TextureHandle handle, HitRecord *hrec);
 Vec3 material_emit(World *world, Ray ray, HitRecord hrec, RayCastData data);
 
 bool object_hit(World *world, Ray ray, ObjectHandle obj_handle, f32 t_min, f32 t_max, HitRecord *hrec, RayCastData data);
+// Returns true if ray hits anything with t in (t_min, t_max). Hierarchies are left at first hit found
+// and no hit record is filled, so this is cheaper than object_hit for visibility tests like shadow rays
+bool object_occluded(World *world, Ray ray, ObjectHandle obj_handle, f32 t_min, f32 t_max, RayCastData data);
+// Occlusion test of ray segment from world root, t_max usually is distance to light
+bool world_occluded(World *world, Ray ray, f32 t_max, RayCastData data);
 Bounds3 get_object_bounds(World *world, ObjectHandle obj_handle);
+// Bounds of object at given time. Only animated transforms are moving, bounds of others don't depend on time
+Bounds3 get_object_bounds_at_time(World *world, ObjectHandle obj_handle, f32 time);
 // f32 get_object_pdf_value(World *world, ObjectHandle object_handle, Vec3 orig, Vec3 v, RayCastData data);
 // Returns randomu point inside object
 // Vec3 get_object_random(World *world, ObjectHandle object_handle, Vec3 o, RayCastData data, ObjectHandle *a);
@@ -0,0 +1,170 @@
+#include "wavefront.h"
+
+static WavefrontPaths
+wavefront_alloc_paths(MemoryArena *arena, u32 capacity) {
+    WavefrontPaths paths;
+    paths.count = 0;
+    paths.ray = arena_alloc(arena, sizeof(Ray) * capacity);
+    paths.throughput = arena_alloc(arena, sizeof(Vec3) * capacity);
+    paths.radiance = arena_alloc(arena, sizeof(Vec3) * capacity);
+    paths.pixel_index = arena_alloc(arena, sizeof(u32) * capacity);
+    paths.has_hit = arena_alloc(arena, sizeof(bool) * capacity);
+    paths.hrec = arena_alloc(arena, sizeof(HitRecord) * capacity);
+    return paths;
+}
+
+Wavefront
+wavefront_init(World *world, u32 capacity) {
+    Wavefront wavefront = {0};
+    wavefront.capacity = capacity;
+    wavefront.material_count = (u32)world->materials_size;
+
+    u64 path_size = sizeof(Ray) + 2 * sizeof(Vec3) + sizeof(u32) + sizeof(bool) + sizeof(HitRecord);
+    // Each array is aligned in arena, so reserve space for padding too
+    u64 memory_size = 2 * capacity * path_size + sizeof(u32) * (2 * wavefront.material_count + 1) +
+        16 * DEFAULT_ALIGNMENT;
+    wavefront.memory = malloc(memory_size);
+    MemoryArena arena = memory_arena(wavefront.memory, memory_size);
+    wavefront.paths = wavefront_alloc_paths(&arena, capacity);
+    wavefront.sorted_paths = wavefront_alloc_paths(&arena, capacity);
+    wavefront.material_ranks = arena_alloc(&arena, sizeof(u32) * wavefront.material_count);
+    wavefront.rank_offsets = arena_alloc(&arena, sizeof(u32) * (wavefront.material_count + 1));
+
+    // Materials of same type run same code when shading, so they are put next to each other
+    u32 rank = 0;
+    for (u32 type = 0;
+         type < MaterialType_Count;
+         ++type) {
+        for (u32 material_index = 0;
+             material_index < wavefront.material_count;
+             ++material_index) {
+            if (world->materials[material_index].type == type) {
+                wavefront.material_ranks[material_index] = rank++;
+            }
+        }
+    }
+    assert(rank == wavefront.material_count);
+
+    return wavefront;
+}
+
+void
+wavefront_free(Wavefront *wavefront) {
+    free(wavefront->memory);
+    *wavefront = (Wavefront) {0};
+}
+
+static void
+wavefront_copy_path(WavefrontPaths *dst, u32 dst_index, WavefrontPaths *src, u32 src_index) {
+    dst->ray[dst_index] = src->ray[src_index];
+    dst->throughput[dst_index] = src->throughput[src_index];
+    dst->radiance[dst_index] = src->radiance[src_index];
+    dst->pixel_index[dst_index] = src->pixel_index[src_index];
+}
+
+static void
+wavefront_end_path(WavefrontPaths *paths, u32 path_index, Vec3 *pixel_colors, f32 color_multiplier) {
+    Vec3 sample_color = sample_color_remove_nans(paths->radiance[path_index]);
+    Vec3 *pixel_color = pixel_colors + paths->pixel_index[path_index];
+    *pixel_color = v3add(*pixel_color, v3muls(sample_color, color_multiplier));
+}
+
+void
+wavefront_trace(World *world, Wavefront *wavefront, i32 depth, BVHEntryNodes *entry,
+                Vec3 *pixel_colors, f32 color_multiplier, RayCastData data) {
+    for (u32 bounce = 0;
+         bounce < (u32)depth && wavefront->paths.count;
+         ++bounce) {
+        WavefrontPaths *paths = &wavefront->paths;
+        WavefrontPaths *sorted_paths = &wavefront->sorted_paths;
+        data.stats->bounce_count += paths->count;
+
+        // Camera rays of neighbouring paths come from neighbouring pixels, so they are traced in packets.
+        // Bounced rays are not coherent and are traced one by one
+        if (bounce == 0) {
+            for (u32 packet_start = 0;
+                 packet_start < paths->count;
+                 packet_start += RAY_PACKET_MAX_SIZE) {
+                u32 ray_count = paths->count - packet_start;
+                if (ray_count > RAY_PACKET_MAX_SIZE) {
+                    ray_count = RAY_PACKET_MAX_SIZE;
+                }
+                memset(paths->hrec + packet_start, 0, sizeof(HitRecord) * ray_count);
+                ray_packet_hit(world, ray_count, paths->ray + packet_start, paths->has_hit + packet_start,
+                               paths->hrec + packet_start, data, entry);
+            }
+        } else {
+            for (u32 path_index = 0;
+                 path_index < paths->count;
+                 ++path_index) {
+                paths->hrec[path_index] = (HitRecord) {0};
+                paths->has_hit[path_index] = object_hit(world, paths->ray[path_index], world->obj_list,
+                                                        DISTANCE_EPSILON, INFINITY, paths->hrec + path_index, data);
+            }
+        }
+
+        // Paths that missed end here. Paths that hit are counting sorted by material rank
+        u32 *rank_offsets = wavefront->rank_offsets;
+        memset(rank_offsets, 0, sizeof(u32) * (wavefront->material_count + 1));
+        for (u32 path_index = 0;
+             path_index < paths->count;
+             ++path_index) {
+            if (paths->has_hit[path_index]) {
+                u32 rank = wavefront->material_ranks[paths->hrec[path_index].mat.v];
+                ++rank_offsets[rank + 1];
+            } else {
+                paths->radiance[path_index] = v3add(paths->radiance[path_index],
+                                                    v3mul(paths->throughput[path_index], world->backgorund_color));
+                wavefront_end_path(paths, path_index, pixel_colors, color_multiplier);
+            }
+        }
+        for (u32 rank = 0;
+             rank < wavefront->material_count;
+             ++rank) {
+            rank_offsets[rank + 1] += rank_offsets[rank];
+        }
+        sorted_paths->count = rank_offsets[wavefront->material_count];
+        for (u32 path_index = 0;
+             path_index < paths->count;
+             ++path_index) {
+            if (paths->has_hit[path_index]) {
+                u32 rank = wavefront->material_ranks[paths->hrec[path_index].mat.v];
+                u32 sorted_index = rank_offsets[rank]++;
+                wavefront_copy_path(sorted_paths, sorted_index, paths, path_index);
+                sorted_paths->hrec[sorted_index] = paths->hrec[path_index];
+            }
+        }
+
+        // Shading goes over runs of paths with same material. Paths that continue are compacted
+        // to the start of buffer, which becomes current one for next bounce
+        u32 alive_count = 0;
+        for (u32 path_index = 0;
+             path_index < sorted_paths->count;
+             ++path_index) {
+            bool is_alive = path_shade_hit(world, sorted_paths->ray + path_index, sorted_paths->hrec + path_index, bounce,
+                                           sorted_paths->throughput + path_index, sorted_paths->radiance + path_index, data);
+            if (is_alive) {
+                if (alive_count != path_index) {
+                    wavefront_copy_path(sorted_paths, alive_count, sorted_paths, path_index);
+                }
+                ++alive_count;
+            } else {
+                wavefront_end_path(sorted_paths, path_index, pixel_colors, color_multiplier);
+            }
+        }
+        sorted_paths->count = alive_count;
+        paths->count = 0;
+
+        WavefrontPaths temp = wavefront->paths;
+        wavefront->paths = wavefront->sorted_paths;
+        wavefront->sorted_paths = temp;
+    }
+
+    // Paths that reached depth limit end without background contribution, same as in ray_cast
+    for (u32 path_index = 0;
+         path_index < wavefront->paths.count;
+         ++path_index) {
+        wavefront_end_path(&wavefront->paths, path_index, pixel_colors, color_multiplier);
+    }
+    wavefront->paths.count = 0;
+}
@@ -0,0 +1,49 @@
+#if !defined(WAVEFRONT_H)
+
+#include "general.h"
+#include "trace.h"
+
+// Wavefront integrator. Instead of tracing each sample to the end like ray_cast does,
+// paths of many samples are advanced together one bounce at a time.
+// Every bounce intersects all active paths, then reorders hit paths by material,
+// so shading runs over contiguous batches of paths with same material
+
+// Paths traced at once, tiles with more samples are traced in several waves.
+// Kept small enough for path buffers to stay in cache
+#define WAVEFRONT_MAX_PATH_COUNT (1 << 12)
+
+// States of paths, each field in its own array
+typedef struct {
+    u32 count;
+    Ray *ray;
+    Vec3 *throughput;
+    Vec3 *radiance;
+    // Index of pixel color sample is added to
+    u32 *pixel_index;
+    bool *has_hit;
+    HitRecord *hrec;
+} WavefrontPaths;
+
+typedef struct {
+    u32 capacity;
+    // Paths of current bounce, and ones reordered by material for shading.
+    // Surviving paths are compacted in place and buffers are swapped
+    WavefrontPaths paths;
+    WavefrontPaths sorted_paths;
+    // Position of material in sorted order: by type, then by handle
+    u32 *material_ranks;
+    u32 *rank_offsets;
+    u32 material_count;
+    void *memory;
+} Wavefront;
+
+Wavefront wavefront_init(World *world, u32 capacity);
+void wavefront_free(Wavefront *wavefront);
+// Traces paths currently in wavefront->paths until all of them end.
+// Color of each path is multiplied by color_multiplier and added to pixel_colors[pixel_index].
+// Camera rays are intersected in packets, starting from entry nodes if they are set
+void wavefront_trace(World *world, Wavefront *wavefront, i32 depth, BVHEntryNodes *entry,
+                     Vec3 *pixel_colors, f32 color_multiplier, RayCastData data);
+
+#define WAVEFRONT_H 1
+#endif
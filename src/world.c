@@ -3,10 +3,14 @@
 
 Ray 
 make_ray(Vec3 orig, Vec3 dir, f32 time) {
+    // Sign is taken from inverse, so -0 components give -INFINITY with matching slab order
+    Vec3 inv_dir = v3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
     return (Ray) {
         .orig = orig,
         .dir = dir,
-        .time = time
+        .time = time,
+        .inv_dir = inv_dir,
+        .dir_is_neg = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f }
     };
 }
 
@@ -140,9 +144,100 @@ camera_make_ray(Camera *camera, RandomSeries *entropy, f32 u, f32 v) {
     return ray;
 }
 
+static void 
+frustum_set_plane(Frustum *frustum, u32 index, Vec3 n, f32 d) {
+    // Planes are pushed out a bit, so rays grazing them are not culled because of rounding
+    f32 inv_length = 1.0f / length(n);
+    frustum->n[index] = v3muls(n, inv_length);
+    frustum->d[index] = d * inv_length;
+    frustum->d[index] += 1e-4f * (1.0f + abs32(frustum->d[index]));
+}
+
+bool 
+camera_make_frustum(Camera *camera, f32 u_min, f32 v_min, f32 u_max, f32 v_max, Frustum *frustum) {
+    bool result = true;
+    switch (camera->type) {
+        case CameraType_Perspective: {
+            // In camera space, rays start at lens disk of lens_radius around origin and pass through focus plane 
+            // at focus_dist. At depth z, ray starting at lens point o and aimed at focus plane point f has 
+            // x = o * (1 - z / focus_dist) + f * z / focus_dist. Over all lens points, it is not less than 
+            // -lens_radius + (f - lens_radius) * z / focus_dist, which gives plane for every side of tile
+            Vec3 o = camera->orig;
+            Vec3 to_corner = v3sub(camera->lower_left_corner, o);
+            f32 focus_dist = -dot(to_corner, camera->z);
+            f32 x_min = dot(to_corner, camera->x) + u_min * length(camera->horizontal);
+            f32 x_max = dot(to_corner, camera->x) + u_max * length(camera->horizontal);
+            f32 y_min = dot(to_corner, camera->y) + v_min * length(camera->vertical);
+            f32 y_max = dot(to_corner, camera->y) + v_max * length(camera->vertical);
+            f32 r = camera->lens_radius;
+            
+            Vec3 n = v3add(camera->x, v3muls(camera->z, (x_min - r) / focus_dist));
+            frustum_set_plane(frustum, 0, n, r - dot(o, n));
+            n = v3neg(v3add(camera->x, v3muls(camera->z, (x_max + r) / focus_dist)));
+            frustum_set_plane(frustum, 1, n, r - dot(o, n));
+            n = v3add(camera->y, v3muls(camera->z, (y_min - r) / focus_dist));
+            frustum_set_plane(frustum, 2, n, r - dot(o, n));
+            n = v3neg(v3add(camera->y, v3muls(camera->z, (y_max + r) / focus_dist)));
+            frustum_set_plane(frustum, 3, n, r - dot(o, n));
+            frustum_set_plane(frustum, 4, v3neg(camera->z), dot(o, camera->z));
+            frustum->view_dir = v3add3(to_corner, v3muls(camera->horizontal, (u_min + u_max) * 0.5f), 
+                                       v3muls(camera->vertical, (v_min + v_max) * 0.5f));
+        } break;
+        case CameraType_Orthographic: {
+            // Rays start at tile rectangle and go along -z
+            Vec3 corner = v3add(camera->lower_left_corner, camera->orig);
+            Vec3 o_min = v3add3(corner, v3muls(camera->horizontal, u_min), v3muls(camera->vertical, v_min));
+            Vec3 o_max = v3add3(corner, v3muls(camera->horizontal, u_max), v3muls(camera->vertical, v_max));
+            frustum_set_plane(frustum, 0, camera->x, -dot(o_min, camera->x));
+            frustum_set_plane(frustum, 1, v3neg(camera->x), dot(o_max, camera->x));
+            frustum_set_plane(frustum, 2, camera->y, -dot(o_min, camera->y));
+            frustum_set_plane(frustum, 3, v3neg(camera->y), dot(o_max, camera->y));
+            frustum_set_plane(frustum, 4, v3neg(camera->z), dot(o_min, camera->z));
+            frustum->view_dir = v3neg(camera->z);
+        } break;
+        case CameraType_Environment: {
+            result = false;
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    return result;
+}
+
+FrustumTest 
+frustum_test_bounds(Frustum *frustum, Bounds3 bounds) {
+    FrustumTest result = FrustumTest_Inside;
+    for (u32 plane_index = 0;
+         plane_index < FRUSTUM_PLANE_COUNT;
+         ++plane_index) {
+        // Corners farthest along and against plane normal
+        Vec3 n = frustum->n[plane_index];
+        Vec3 p_far = v3(n.x > 0.0f ? bounds.max.x : bounds.min.x,
+                        n.y > 0.0f ? bounds.max.y : bounds.min.y,
+                        n.z > 0.0f ? bounds.max.z : bounds.min.z);
+        Vec3 p_near = v3(n.x > 0.0f ? bounds.min.x : bounds.max.x,
+                         n.y > 0.0f ? bounds.min.y : bounds.max.y,
+                         n.z > 0.0f ? bounds.min.z : bounds.max.z);
+        if (dot(n, p_far) + frustum->d[plane_index] < 0.0f) {
+            result = FrustumTest_Outside;
+            break;
+        }
+        if (dot(n, p_near) + frustum->d[plane_index] < 0.0f) {
+            result = FrustumTest_Intersects;
+        }
+    }
+    return result;
+}
 
 // Dynamic array hacks
 #define DEFAULT_ARRAY_CAPACITY 10
+// Root object list with fewer objects is not worth building hierarchy over
+#define WORLD_COMMIT_MIN_BVH_OBJECTS 4
+// Time range of motion hierarchy is split in halves while objects move more than that, 
+// measured as ratio of total area of bounds of their paths to total area of their bounds
+#define MOTION_BVH_SPLIT_THRESHOLD 2.0f
+#define MOTION_BVH_MAX_SEGMENTS 16
+// Bounds of rotating objects are sampled that many times inside time segment
+#define MOTION_BVH_BOUNDS_SAMPLES 8
 #define IAMLAZYTOINITWORLD(_a, _arr, _capacity) { if (!_capacity) { _capacity = DEFAULT_ARRAY_CAPACITY; _arr = arena_alloc(_a, sizeof(*_arr) * _capacity); } }
 #define EXPAND_IF_NEEDED(_a, _arr, _size, _capacity) { IAMLAZYTOINITWORLD(_a, _arr, _capacity);  \
     if (_size + 1 > _capacity) { _arr = arena_realloc(_a, _arr, sizeof(*_arr) * _capacity, sizeof(*_arr) * _capacity * 2); _capacity *= 2; } }
@@ -199,6 +294,12 @@ world_init(World *world) {
     
     world->obj_list = object_list(world);
     world->important_objects = object_list(world);
+    // Cached bounds are zero-initialized and must not be valid
+    world->bounds_version = 1;
+    
+    world->bvh_settings.method = BVHBuildMethod_BinnedSAH;
+    world->bvh_settings.thread_count = get_core_count();
+    world->bvh_settings.spatial_split_budget = 1.5f;
 }
 
 TextureHandle 
@@ -235,6 +336,7 @@ has_enough_object_space_or_expand(World *world, u32 requested) {
 ObjectHandle 
 new_object(World *world, Object obj) {
     assert(obj.type);
+    assert(!world->is_committed);
     has_enough_object_space_or_expand(world, 1);
     // EXPAND_IF_NEEDED(&world->arena, world->objects, world->objects_size, world->objects_capacity);
     
@@ -263,11 +365,18 @@ ObjectHandle
 add_object(World *world, ObjectHandle list_handle, ObjectHandle obj) {
     Object *list = get_object(world, list_handle);
     assert(list->type == ObjectType_ObjectList);
+    assert(!world->is_committed);
  
     add_object_to_list(&list->obj_list, obj);   
+    world_invalidate_bounds(world);
     return obj;
 }
 
+void
+world_invalidate_bounds(World *world) {
+    ++world->bounds_version;
+}
+
 ObjectHandle 
 add_object_to_world(World *world, ObjectHandle o) {
     add_object(world, world->obj_list, o);
@@ -495,62 +604,7 @@ object_box(World *world, Vec3 p0, Vec3 p1, MaterialHandle mat) {
     Object obj;
     obj.type = ObjectType_Box;
     obj.box.bounds = bounds3(p0, p1);
-#if 1
-    u32 vi[] = {
-        1, 2, 3, 7, 6, 5, 4, 8, 9, 10, 11, 12, 13, 14, 15, 0, 16,
-        17, 18, 1, 3, 19, 7, 5, 20, 4, 9, 21, 10, 12, 22, 13, 15, 23, 0, 17,  
-    };
-    Vec3 p[] = {
-        v3(p1.x, p0.y, p0.z), v3(p1.x, p0.y, p1.z), 
-        v3(p0.x, p0.y, p1.z), v3(p0.x, p0.y, p0.z),
-        v3(p1.x, p1.y, p0.z), v3(p1.x, p1.y, p1.z), 
-        v3(p0.x, p1.y, p1.z), v3(p0.x, p1.y, p0.z),
-        v3(p1.x, p1.y, p1.z), v3(p1.x, p0.y, p1.z),
-        v3(p1.x, p1.y, p1.z), v3(p0.x, p1.y, p1.z),
-        v3(p0.x, p0.y, p1.z), v3(p0.x, p0.y, p1.z),
-        v3(p0.x, p1.y, p1.z), v3(p0.x, p1.y, p0.z),
-        v3(p0.x, p0.y, p0.z), v3(p0.x, p1.y, p0.z),
-        v3(p1.x, p0.y, p0.z), v3(p1.x, p1.y, p0.z),
-        v3(p1.x, p0.y, p0.z), v3(p1.x, p0.y, p1.z),
-        v3(p0.x, p0.y, p0.z), v3(p1.x, p1.y, p0.z),
-    };
-    Vec3 n[] = {
-        v3(0.000000, 0.000000, -0.999756), v3(0.000000, -0.999756, 0.000000), 
-        v3(0.000000, -0.999756, 0.000000), v3(0.000000, -0.999756, 0.000000),
-        v3(0.999756, 0.000000, 0.000000), v3(0.000000, 0.999756, 0.000000),
-        v3(0.000000, 0.999756, 0.000000), v3(0.000000, 0.999756, 0.000000), 
-        v3(0.999756, 0.000000, 0.000000), v3(0.999756, 0.000000, 0.000000), 
-        v3(-0.000000, 0.000000, 0.999756), v3(-0.000000, 0.000000, 0.999756), 
-        v3(-0.000000, 0.000000, 0.999756), v3(-0.999756, -0.000000, -0.000000), 
-        v3(-0.999756, -0.000000, -0.000000), v3(-0.999756, -0.000000, -0.000000), 
-        v3(0.000000, 0.000000, -0.999756), v3(0.000000, 0.000000, -0.999756), 
-        v3(0.000000, -0.999756, 0.000000), v3(0.000000, 0.999756, 0.000000),
-        v3(0.999756, 0.000000, 0.000000), v3(-0.000000, 0.000000, 0.999756),
-        v3(-0.999756, -0.000000, -0.000000), v3(0.000000, 0.000000, -0.999756),
-    };
-    Vec2 uv[] = {
-        v2(0.000000, 0.333333), v2(0.000000, 1.000000), v2(0.000000, 1.000000), 
-        v2(0.000000, 0.666667), v2(0.000000, 0.000000), v2(0.000000, 0.666667), 
-        v2(0.000000, 0.666667), v2(0.000000, 1.000000), v2(0.000000, 0.000000), 
-        v2(0.000000, 0.333333), v2(0.000000, 0.333333), v2(0.000000, 0.666667), 
-        v2(0.000000, 0.666667), v2(0.000000, 0.333333), v2(0.000000, 0.000000), 
-        v2(0.000000, 0.000000), v2(0.000000, 0.333333), v2(0.000000, 0.000000), 
-        v2(0.000000, 0.666667), v2(0.000000, 1.000000), v2(0.000000, 0.333333), 
-        v2(0.000000, 0.333333), v2(0.000000, 0.333333), v2(0.000000, 0.000000),
-    };
-    
-    TriangleMeshData box;
-    box.ntrig = 12;
-    box.nvert = 24;
-    box.tri_indices = vi;
-    box.p = p;
-    box.n = n;
-    box.uv = uv;
-    obj.box.sides = object_triangle_mesh_t(world, box, mat);
-#else 
-    obj.box.sides = object_listr(world, 12);
-    add_box(world,obj.box.sides, p0, p1, mat);
-#endif 
+    obj.box.mat = mat;
     return new_object(world, obj);        
 }
 
@@ -561,93 +615,220 @@ object_constant_medium(World *world, f32 d, MaterialHandle phase, ObjectHandle b
     obj.constant_medium.boundary = bound;
     obj.constant_medium.neg_inv_density = -1.0f / d;
     obj.constant_medium.phase_function = phase;
+    // Bounds are computed on first request
+    obj.constant_medium.bounds_version = 0;
     
     return new_object(world, obj);        
 }
 
+// Hierarchy of objects depends only on their bounds
+static u64 
+bvh_primitive_bounds_hash(BVHPrimitive *prims, u32 n) {
+    u64 hash = BVH_HASH_SEED;
+    for (u32 prim_index = 0;
+         prim_index < n;
+         ++prim_index) {
+        hash = bvh_hash(hash, &prims[prim_index].bounds, sizeof(Bounds3));
+    }
+    return hash;
+}
+
+// Builds hierarchy, or loads it from cache, and accounts its memory
+static BVH 
+world_build_bvh(World *world, BVHPrimitive *prims, u32 n, BVHBuildSettings settings, u64 content_hash) {
+    BVH bvh = build_bvh_cached(&world->arena, prims, n, settings, content_hash);
+    world->bvh_node_memory += bvh.node_count * sizeof(BVHNode) + bvh.wide_node_count * 
+        (bvh.compressed_nodes ? sizeof(BVHCompressedNode) : sizeof(BVHWideNode));
+    world->bvh_traversal_node_memory += bvh_traversal_node_memory(&bvh);
+    if (settings.report && settings.optimize_pass_count && !bvh.is_cached && bvh.unoptimized_sah_cost > 0.0f) {
+        printf("BVH optimization (%u passes): SAH cost %.2f -> %.2f (%.1f%%), %.2fms\n", settings.optimize_pass_count, 
+               bvh.unoptimized_sah_cost, bvh.build_sah_cost, 
+               100.0f * (bvh.build_sah_cost - bvh.unoptimized_sah_cost) / bvh.unoptimized_sah_cost, bvh.optimize_time_ms);
+    }
+    return bvh;
+}
+
 ObjectHandle 
-object_bvh_node(World *world, ObjectHandle *objs_init, i64 n) {
+object_bvh_node(World *world, ObjectHandle *objs, i64 n) {
     Object obj;
     obj.type = ObjectType_BVH;
     
-    has_enough_object_space_or_expand(world, n);
-    
-    TempMemory temp_mem = temp_memory_begin(&world->arena);
-    Bounds3 *objs_bounds = arena_alloc(&world->arena, sizeof(Bounds3) * n); 
-    f32 *left_area  = arena_alloc(&world->arena, sizeof(f32) * n); 
-    f32 *right_area = arena_alloc(&world->arena, sizeof(f32) * n); 
-    ObjectHandle *objs = arena_copy(&world->arena, objs_init, n * sizeof(ObjectHandle));
-    
-    Bounds3 main_bounds = bounds3empty();
+    BVHPrimitive *prims = malloc(sizeof(BVHPrimitive) * n);
     for (u32 obj_index = 0;
          obj_index < n;
          ++obj_index) {
-        ObjectHandle obj_handle = objs[obj_index];
-        Bounds3 temp_bounds = get_object_bounds(world, obj_handle);
-        main_bounds = bounds3_join(main_bounds, temp_bounds);
+        prims[obj_index].bounds = get_object_bounds(world, objs[obj_index]);
+        prims[obj_index].index = obj_index;
     }
     
-    u32 axis = bounds3s_longest_axis(main_bounds);
-#if OS_LINUX || OS_MACOS
-#define qsort_s qsort_r
-#endif 
-    if (axis == 0) {
-        qsort_s(objs, n, sizeof(ObjectHandle), bounds3_compare_x, world);
-    } else if (axis == 1) {
-        qsort_s(objs, n, sizeof(ObjectHandle), bounds3_compare_y, world);
-    } else {
-        qsort_s(objs, n, sizeof(ObjectHandle), bounds3_compare_z, world);
+    obj.bvh.tree = world_build_bvh(world, prims, n, world->bvh_settings, bvh_primitive_bounds_hash(prims, n));
+    obj.bvh.objs = arena_alloc(&world->arena, sizeof(ObjectHandle) * obj.bvh.tree.prim_count);
+    for (u32 prim_index = 0;
+         prim_index < obj.bvh.tree.prim_count;
+         ++prim_index) {
+        obj.bvh.objs[prim_index] = objs[obj.bvh.tree.prims[prim_index]];
     }
+    free(prims);
     
-    for (u32 obj_index = 0;
-         obj_index < n;
-         ++obj_index) {
-        ObjectHandle obj_handle = objs[obj_index];
-        objs_bounds[obj_index] = get_object_bounds(world, obj_handle);
+    if (world->bvh_settings.report) {
+        printf("BVH %s (%s): %llu objects, %u nodes, %u wide nodes, %.2fms\n", obj.bvh.tree.is_cached ? "load" : "build", 
+               bvh_build_method_to_string(world->bvh_settings.method), (unsigned long long)n, obj.bvh.tree.node_count, 
+               obj.bvh.tree.wide_node_count, obj.bvh.tree.build_time_ms);
     }
     
-    Bounds3 left_bounds = bounds3empty();
-    for (u32 obj_index = 0;
-         obj_index < n;
-         ++obj_index) {
-        left_bounds = bounds3_join(left_bounds, objs_bounds[obj_index]);
-        left_area[obj_index] = bound3s_surface_area(left_bounds);
-    }
-    Bounds3 right_bounds = bounds3empty();
-    for (i32 obj_index = n - 1;
-         obj_index > 0;
-         --obj_index) {
-        right_bounds = bounds3_join(right_bounds, objs_bounds[obj_index]);
-        right_area[obj_index] = bound3s_surface_area(right_bounds);        
+    return new_object(world, obj);        
+}
+
+ObjectHandle 
+object_instance_bvh(World *world, ObjectInstance *instances, u32 n) {
+    Object obj;
+    obj.type = ObjectType_InstanceBVH;
+    
+    BVHPrimitive *prims = malloc(sizeof(BVHPrimitive) * n);
+    for (u32 instance_index = 0;
+         instance_index < n;
+         ++instance_index) {
+        ObjectInstance *instance = instances + instance_index;
+        prims[instance_index].bounds = transform_bounds(get_object_bounds(world, instance->obj), instance->t.o2w);
+        prims[instance_index].index = instance_index;
     }
     
-    f32 min_sah = INFINITY;
-    u32 min_sah_index;
-    for (u32 object_index = 0;
-         object_index < n - 1;
-         ++object_index) {
-        f32 sah = object_index * left_area[object_index] + (n - object_index - 1) * right_area[object_index + 1];
-        if (sah < min_sah) {
-            min_sah_index = object_index;
-            min_sah = sah;
-        }        
+    obj.instance_bvh.tree = world_build_bvh(world, prims, n, world->bvh_settings, bvh_primitive_bounds_hash(prims, n));
+    obj.instance_bvh.instances = arena_alloc(&world->arena, sizeof(ObjectInstance) * obj.instance_bvh.tree.prim_count);
+    for (u32 prim_index = 0;
+         prim_index < obj.instance_bvh.tree.prim_count;
+         ++prim_index) {
+        obj.instance_bvh.instances[prim_index] = instances[obj.instance_bvh.tree.prims[prim_index]];
     }
+    free(prims);
     
-    if (min_sah_index == 0) {
-        obj.bvh_node.left = objs[0];
-    } else {
-        obj.bvh_node.left = object_bvh_node(world, objs, min_sah_index + 1);
+    if (world->bvh_settings.report) {
+        printf("Instance BVH %s (%s): %u instances, %u nodes, %u wide nodes, %.2fms\n", obj.instance_bvh.tree.is_cached ? "load" : "build", 
+               bvh_build_method_to_string(world->bvh_settings.method), n, obj.instance_bvh.tree.node_count, 
+               obj.instance_bvh.tree.wide_node_count, obj.instance_bvh.tree.build_time_ms);
     }
     
-    if (min_sah_index == n - 2) {
-        obj.bvh_node.right = objs[min_sah_index + 1];
-    } else {
-        obj.bvh_node.right = object_bvh_node(world, objs + min_sah_index + 1, n - min_sah_index - 1);
+    return new_object(world, obj);        
+}
+
+// Bounds of rotating objects don't change linearly, so they are sampled inside time range
+// and bounds at its ends are extended until their interpolation contains samples
+static void
+motion_bvh_object_bounds(World *world, ObjectHandle obj, f32 time0, f32 time1, Bounds3 *start, Bounds3 *end) {
+    *start = get_object_bounds_at_time(world, obj, time0);
+    *end = get_object_bounds_at_time(world, obj, time1);
+    if (get_object(world, obj)->type == ObjectType_AnimatedTransform) {
+        Vec3 grow_min = v3s(0);
+        Vec3 grow_max = v3s(0);
+        for (u32 sample_index = 1;
+             sample_index < MOTION_BVH_BOUNDS_SAMPLES;
+             ++sample_index) {
+            f32 t = (f32)sample_index / MOTION_BVH_BOUNDS_SAMPLES;
+            Bounds3 sample = get_object_bounds_at_time(world, obj, lerp(time0, time1, t));
+            Vec3 below = v3sub(v3lerp(start->min, end->min, t), sample.min);
+            Vec3 above = v3sub(sample.max, v3lerp(start->max, end->max, t));
+            grow_min = v3(max32(grow_min.x, below.x), max32(grow_min.y, below.y), max32(grow_min.z, below.z));
+            grow_max = v3(max32(grow_max.x, above.x), max32(grow_max.y, above.y), max32(grow_max.z, above.z));
+        }
+        start->min = v3sub(start->min, grow_min);
+        end->min = v3sub(end->min, grow_min);
+        start->max = v3add(start->max, grow_max);
+        end->max = v3add(end->max, grow_max);
+    }
+}
+
+// Largest motion of objects among time segments, see MOTION_BVH_SPLIT_THRESHOLD
+static f32 
+motion_bvh_max_motion(World *world, ObjectHandle *objs, u32 n, f32 time0, f32 time1, u32 segment_count) {
+    f32 result = 0.0f;
+    for (u32 segment_index = 0;
+         segment_index < segment_count;
+         ++segment_index) {
+        f32 segment_time0 = lerp(time0, time1, (f32)segment_index / segment_count);
+        f32 segment_time1 = lerp(time0, time1, (f32)(segment_index + 1) / segment_count);
+        f32 path_area = 0.0f;
+        f32 area = 0.0f;
+        for (u32 obj_index = 0;
+             obj_index < n;
+             ++obj_index) {
+            Bounds3 start = get_object_bounds_at_time(world, objs[obj_index], segment_time0);
+            Bounds3 end = get_object_bounds_at_time(world, objs[obj_index], segment_time1);
+            path_area += bound3s_surface_area(bounds3_join(start, end));
+            area += 0.5f * (bound3s_surface_area(start) + bound3s_surface_area(end));
+        }
+        if (area > 0.0f) {
+            result = max32(result, path_area / area);
+        }
+    }
+    return result;
+}
+
+ObjectHandle 
+object_motion_bvh(World *world, ObjectHandle *objs, u32 n, f32 time0, f32 time1) {
+    Object obj;
+    obj.type = ObjectType_MotionBVH;
+    obj.motion_bvh.time[0] = time0;
+    obj.motion_bvh.time[1] = time1;
+    obj.motion_bvh.segment_count = 1;
+    while (obj.motion_bvh.segment_count < MOTION_BVH_MAX_SEGMENTS && 
+           motion_bvh_max_motion(world, objs, n, time0, time1, obj.motion_bvh.segment_count) > MOTION_BVH_SPLIT_THRESHOLD) {
+        obj.motion_bvh.segment_count *= 2;
     }
+    obj.motion_bvh.segments = arena_alloc(&world->arena, sizeof(MotionBVHSegment) * obj.motion_bvh.segment_count);
+    
+    // Interpolated bounds are only supported by binary nodes
+    BVHBuildSettings settings = world->bvh_settings;
+    settings.layout = BVHLayout_Binary;
+    BVHPrimitive *prims = malloc(sizeof(BVHPrimitive) * n);
+    Bounds3 *start_bounds = malloc(sizeof(Bounds3) * n);
+    Bounds3 *end_bounds = malloc(sizeof(Bounds3) * n);
+    f64 build_time = 0;
+    u32 node_count = 0;
+    for (u32 segment_index = 0;
+         segment_index < obj.motion_bvh.segment_count;
+         ++segment_index) {
+        f32 segment_time0 = lerp(time0, time1, (f32)segment_index / obj.motion_bvh.segment_count);
+        f32 segment_time1 = lerp(time0, time1, (f32)(segment_index + 1) / obj.motion_bvh.segment_count);
+        // Hierarchy is built over bounds of paths of objects in segment and then fit to bounds at its ends
+        for (u32 obj_index = 0;
+             obj_index < n;
+             ++obj_index) {
+            motion_bvh_object_bounds(world, objs[obj_index], segment_time0, segment_time1, 
+                                     start_bounds + obj_index, end_bounds + obj_index);
+            prims[obj_index].bounds = bounds3_join(start_bounds[obj_index], end_bounds[obj_index]);
+            prims[obj_index].index = obj_index;
+        }
+        
+        MotionBVHSegment *segment = obj.motion_bvh.segments + segment_index;
+        segment->tree = world_build_bvh(world, prims, n, settings, bvh_primitive_bounds_hash(prims, n));
+        segment->objs = arena_alloc(&world->arena, sizeof(ObjectHandle) * segment->tree.prim_count);
+        Bounds3 *leaf_start_bounds = malloc(sizeof(Bounds3) * segment->tree.prim_count);
+        Bounds3 *leaf_end_bounds = malloc(sizeof(Bounds3) * segment->tree.prim_count);
+        for (u32 prim_index = 0;
+             prim_index < segment->tree.prim_count;
+             ++prim_index) {
+            u32 obj_index = segment->tree.prims[prim_index];
+            segment->objs[prim_index] = objs[obj_index];
+            leaf_start_bounds[prim_index] = start_bounds[obj_index];
+            leaf_end_bounds[prim_index] = end_bounds[obj_index];
+        }
+        bvh_make_motion(&world->arena, &segment->tree, leaf_start_bounds, leaf_end_bounds);
+        free(leaf_start_bounds);
+        free(leaf_end_bounds);
+        
+        world->bvh_node_memory += segment->tree.node_count * sizeof(Bounds3);
+        world->bvh_traversal_node_memory += segment->tree.node_count * sizeof(Bounds3);
+        build_time += segment->tree.build_time_ms;
+        node_count += segment->tree.node_count;
+    }
+    free(prims);
+    free(start_bounds);
+    free(end_bounds);
     
-    // @NOTE something is very wrong with our allocation strategy here so it causes crash
-    temp_memory_end(temp_mem);
-    obj.bvh_node.bounds = main_bounds;
+    if (settings.report) {
+        printf("Motion BVH build (%s): %u objects, %u time segments, %u nodes, %.2fms\n", 
+               bvh_build_method_to_string(settings.method), n, obj.motion_bvh.segment_count, node_count, build_time);
+    }
     
     return new_object(world, obj);        
 }
@@ -685,6 +866,208 @@ object_animated_transform(World *world, ObjectHandle objh, f32 time0, f32 time1,
     return new_object(world, obj);
 }
 
+static Bounds3 
+triangle_mesh_triangle_bounds(Object *obj, u32 triangle_index) {
+    u32 *indices = obj->triangle_mesh.tri_indices + triangle_index * 3;
+    Bounds3 bounds = bounds3i(obj->triangle_mesh.p[indices[0]]);
+    bounds = bounds3_extend(bounds, obj->triangle_mesh.p[indices[1]]);
+    bounds = bounds3_extend(bounds, obj->triangle_mesh.p[indices[2]]);
+    return bounds;
+}
+
+// Clips triangle with plane, so spatial split builder gets tight bounds of its parts
+static BVH_CLIP_PROC_SIGNATURE(triangle_mesh_clip_proc) {
+    Object *obj = data;
+    u32 *indices = obj->triangle_mesh.tri_indices + index * 3;
+    *left = bounds3empty();
+    *right = bounds3empty();
+    for (u32 vertex_index = 0;
+         vertex_index < 3;
+         ++vertex_index) {
+        Vec3 a = obj->triangle_mesh.p[indices[vertex_index]];
+        Vec3 b = obj->triangle_mesh.p[indices[(vertex_index + 1) % 3]];
+        f32 da = a.e[axis] - position;
+        f32 db = b.e[axis] - position;
+        if (da <= 0.0f) {
+            *left = bounds3_extend(*left, a);
+        }
+        if (da >= 0.0f) {
+            *right = bounds3_extend(*right, a);
+        }
+        // Edge crosses plane
+        if ((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f)) {
+            Vec3 p = v3lerp(a, b, da / (da - db));
+            p.e[axis] = position;
+            *left = bounds3_extend(*left, p);
+            *right = bounds3_extend(*right, p);
+        }
+    }
+}
+
+static void 
+triangle_mesh_build_soa(World *world, Object *obj) {
+    assert(obj->type == ObjectType_TriangleMesh);
+    BVH *bvh = &obj->triangle_mesh.bvh;
+    TriangleSoA *soa = &obj->triangle_mesh.soa;
+    // Refit keeps reference count, so arrays are reused when only vertices have moved
+    if (soa->count != bvh->prim_count) {
+        soa->count = bvh->prim_count;
+        f32 *data = arena_alloc(&world->arena, sizeof(f32) * (9 * soa->count + TRIANGLE_SOA_PADDING));
+        for (u32 axis = 0;
+             axis < 3;
+             ++axis) {
+            soa->v0[axis] = data + (axis    ) * soa->count;
+            soa->e1[axis] = data + (axis + 3) * soa->count;
+            soa->e2[axis] = data + (axis + 6) * soa->count;
+        }
+    }
+    
+    for (u32 prim_index = 0;
+         prim_index < soa->count;
+         ++prim_index) {
+        u32 *indices = obj->triangle_mesh.tri_indices + bvh->prims[prim_index] * 3;
+        Vec3 p0 = obj->triangle_mesh.p[indices[0]];
+        Vec3 e1 = v3sub(obj->triangle_mesh.p[indices[1]], p0);
+        Vec3 e2 = v3sub(obj->triangle_mesh.p[indices[2]], p0);
+        for (u32 axis = 0;
+             axis < 3;
+             ++axis) {
+            soa->v0[axis][prim_index] = p0.e[axis];
+            soa->e1[axis][prim_index] = e1.e[axis];
+            soa->e2[axis][prim_index] = e2.e[axis];
+        }
+    }
+}
+
+static void 
+triangle_mesh_build_bvh(World *world, Object *obj, BVHBuildSettings settings) {
+    assert(obj->type == ObjectType_TriangleMesh);
+    
+    BVHPrimitive *prims = malloc(sizeof(BVHPrimitive) * obj->triangle_mesh.ntrig);
+    for (u32 triangle_index = 0;
+         triangle_index < obj->triangle_mesh.ntrig;
+         ++triangle_index) {
+        prims[triangle_index].bounds = triangle_mesh_triangle_bounds(obj, triangle_index);
+        prims[triangle_index].index = triangle_index;
+    }
+    
+    settings.clip = triangle_mesh_clip_proc;
+    settings.clip_data = obj;
+    u64 content_hash = bvh_hash(BVH_HASH_SEED, obj->triangle_mesh.p, sizeof(Vec3) * obj->triangle_mesh.nvert);
+    content_hash = bvh_hash(content_hash, obj->triangle_mesh.tri_indices, sizeof(u32) * 3 * obj->triangle_mesh.ntrig);
+    obj->triangle_mesh.bvh = world_build_bvh(world, prims, obj->triangle_mesh.ntrig, settings, content_hash);
+    free(prims);
+    triangle_mesh_build_soa(world, obj);
+    
+    if (settings.report) {
+        printf("Mesh BVH %s (%s): %llu triangles, %u references, %u nodes, %.2fms\n", 
+               obj->triangle_mesh.bvh.is_cached ? "load" : "build", bvh_build_method_to_string(settings.method),
+               (unsigned long long)obj->triangle_mesh.ntrig, obj->triangle_mesh.bvh.prim_count, obj->triangle_mesh.bvh.node_count, 
+               obj->triangle_mesh.bvh.build_time_ms);
+    }
+}
+
+bool
+object_refit_bvh(World *world, ObjectHandle obj_handle) {
+    // Primitives have moved, so bounds cached before can't be used for leaves
+    world_invalidate_bounds(world);
+    Object *obj = get_object(world, obj_handle);
+    BVH *bvh = 0;
+    switch (obj->type) {
+        case ObjectType_BVH: {
+            bvh = &obj->bvh.tree;
+        } break;
+        case ObjectType_InstanceBVH: {
+            bvh = &obj->instance_bvh.tree;
+        } break;
+        case ObjectType_TriangleMesh: {
+            bvh = &obj->triangle_mesh.bvh;
+        } break;
+        INVALID_DEFAULT_CASE;
+    }
+    
+    Bounds3 *leaf_bounds = malloc(sizeof(Bounds3) * bvh->prim_count);
+    for (u32 prim_index = 0;
+         prim_index < bvh->prim_count;
+         ++prim_index) {
+        switch (obj->type) {
+            case ObjectType_BVH: {
+                leaf_bounds[prim_index] = get_object_bounds(world, obj->bvh.objs[prim_index]);
+            } break;
+            case ObjectType_InstanceBVH: {
+                ObjectInstance *instance = obj->instance_bvh.instances + prim_index;
+                leaf_bounds[prim_index] = transform_bounds(get_object_bounds(world, instance->obj), instance->t.o2w);
+            } break;
+            case ObjectType_TriangleMesh: {
+                leaf_bounds[prim_index] = triangle_mesh_triangle_bounds(obj, bvh->prims[prim_index]);
+            } break;
+            INVALID_DEFAULT_CASE;
+        }
+    }
+    
+    bool should_rebuild = refit_bvh(bvh, leaf_bounds, world->bvh_settings.thread_count);
+    if (should_rebuild && obj->type == ObjectType_TriangleMesh) {
+        // Mesh is rebuilt from its triangles, not from leaf references, which may be duplicated by spatial splits.
+        // Moving geometry is not worth caching
+        BVHBuildSettings settings = world->bvh_settings;
+        settings.cache_directory = 0;
+        triangle_mesh_build_bvh(world, obj, settings);
+    } else if (should_rebuild) {
+        // @NOTE Old nodes are left in arena
+        u32 n = bvh->prim_count;
+        BVHPrimitive *prims = malloc(sizeof(BVHPrimitive) * n);
+        for (u32 prim_index = 0;
+             prim_index < n;
+             ++prim_index) {
+            prims[prim_index].bounds = leaf_bounds[prim_index];
+            prims[prim_index].index = prim_index;
+        }
+        BVHBuildSettings settings = world->bvh_settings;
+        settings.cache_directory = 0;
+        BVH new_bvh = world_build_bvh(world, prims, n, settings, 0);
+        free(prims);
+        
+        // New hierarchy references leaf slots of old one, so leaf data is reordered accordingly.
+        // Spatial splits can duplicate references, so new arrays are allocated
+        switch (obj->type) {
+            case ObjectType_BVH: {
+                ObjectHandle *objs = obj->bvh.objs;
+                obj->bvh.objs = arena_alloc(&world->arena, sizeof(ObjectHandle) * new_bvh.prim_count);
+                for (u32 prim_index = 0;
+                     prim_index < new_bvh.prim_count;
+                     ++prim_index) {
+                    obj->bvh.objs[prim_index] = objs[new_bvh.prims[prim_index]];
+                }
+            } break;
+            case ObjectType_InstanceBVH: {
+                ObjectInstance *instances = obj->instance_bvh.instances;
+                obj->instance_bvh.instances = arena_alloc(&world->arena, sizeof(ObjectInstance) * new_bvh.prim_count);
+                for (u32 prim_index = 0;
+                     prim_index < new_bvh.prim_count;
+                     ++prim_index) {
+                    obj->instance_bvh.instances[prim_index] = instances[new_bvh.prims[prim_index]];
+                }
+            } break;
+            INVALID_DEFAULT_CASE;
+        }
+        *bvh = new_bvh;
+    }
+    free(leaf_bounds);
+    
+    if (obj->type == ObjectType_TriangleMesh) {
+        if (bvh->node_count) {
+            obj->triangle_mesh.bounds = bvh->nodes[0].bounds;
+        }
+        if (!should_rebuild) {
+            triangle_mesh_build_soa(world, obj);
+        }
+    }
+    // Lists containing this object have to pick up its new bounds
+    world_invalidate_bounds(world);
+    
+    return should_rebuild;
+}
+
 ObjectHandle 
 object_triangle_mesh_pt(World *world, PolygonMeshData pm, MaterialHandle mat, Transform transform) {
     Object obj;
@@ -751,6 +1134,8 @@ object_triangle_mesh_pt(World *world, PolygonMeshData pm, MaterialHandle mat, Tr
     }
     obj.triangle_mesh.mat = mat;
     obj.triangle_mesh.surface_area = surface_area;
+    obj.triangle_mesh.soa = (TriangleSoA) {0};
+    triangle_mesh_build_bvh(world, &obj, world->bvh_settings);
     
     return new_object(world, obj);
 }
@@ -790,6 +1175,8 @@ object_triangle_mesh_tt(World *world, TriangleMeshData tm, MaterialHandle mat, T
     }
     obj.triangle_mesh.mat = mat;
     obj.triangle_mesh.surface_area = surface_area;
+    obj.triangle_mesh.soa = (TriangleSoA) {0};
+    triangle_mesh_build_bvh(world, &obj, world->bvh_settings);
     
     return new_object(world, obj);
 }
@@ -944,3 +1331,48 @@ validate_world(World *world) {
     
     return result;    
 }
+
+void 
+world_commit(World *world) {
+    assert(!world->is_committed);
+    
+    // Important objects stay in list, because they are sampled by picking one of them uniformly,
+    // and pdf of such mixture has to be evaluated for each of them anyway
+    Object *root = get_object(world, world->obj_list);
+    if (root->obj_list.size >= WORLD_COMMIT_MIN_BVH_OBJECTS) {
+        // Copy of list is used, because building hierarchy adds objects and can move object storage
+        u64 n = root->obj_list.size;
+        ObjectHandle *objs = malloc(sizeof(ObjectHandle) * n);
+        bool has_motion = false;
+        for (u64 obj_index = 0;
+             obj_index < n;
+             ++obj_index) {
+            objs[obj_index] = object_list_get(&root->obj_list, obj_index);
+            has_motion |= get_object(world, objs[obj_index])->type == ObjectType_AnimatedTransform;
+        }
+        
+        // Moving objects get bounds at shutter time of ray, instead of bounds of their whole path
+        if (has_motion && world->camera.time_max > world->camera.time_min) {
+            world->obj_list = object_motion_bvh(world, objs, n, world->camera.time_min, world->camera.time_max);
+        } else {
+            world->obj_list = object_bvh_node(world, objs, n);
+        }
+        free(objs);
+    }
+    
+    world->is_committed = true;
+}
+
+void
+world_update(World *world, f32 time) {
+    assert(world->is_committed);
+    if (world->update_scene) {
+        world->update_scene(world, time);
+        // Moved objects could be anywhere in root hierarchy, so it is refitted after them.
+        // Motion hierarchy is built for shutter interval of camera and is kept as is
+        Object *root = get_object(world, world->obj_list);
+        if (root->type == ObjectType_BVH) {
+            object_refit_bvh(world, world->obj_list);
+        }
+    }
+}
@@ -4,6 +4,7 @@
 #include "ray_math.h"
 #include "ray_random.h"
 #include "memory_arena.h"
+#include "bvh.h"
 
 #define DEFAULT_WORLD_ARENA_SIZE MEGABYTES(512)
 
@@ -26,6 +27,18 @@ typedef struct {
     Vec2 *uv;
 } TriangleMeshData;
 
+// Mesh triangles prepared for intersection, stored in order of hierarchy leaf references.
+// First vertex and edges are split into per-component arrays, so leaves are tested with 
+// streaming loads instead of going through tri_indices into p.
+// Arrays are followed by TRIANGLE_SOA_PADDING floats, so wide loads at the end of last leaf stay in bounds
+#define TRIANGLE_SOA_PADDING 7
+typedef struct {
+    u32 count;
+    f32 *v0[3];
+    f32 *e1[3];
+    f32 *e2[3];
+} TriangleSoA;
+
 typedef struct {
     Mat4x4 o2w;
     Mat4x4 w2o;
@@ -54,6 +67,9 @@ typedef struct {
     Vec3 dir;
     // Time of ray being sent
     f32 time;
+    // Precomputed for box tests, which are done for every visited node
+    Vec3 inv_dir;
+    u32 dir_is_neg[3];
 } Ray;
 
 Ray make_ray(Vec3 orig, Vec3 dir, f32 time);
@@ -91,6 +107,28 @@ Camera camera_environment(Vec3 look_from, Vec3 look_at, Vec3 v_up, f32 time_min,
 
 Ray camera_make_ray(Camera *camera, RandomSeries *entropy, f32 u, f32 v);
 
+// Conservative volume containing all camera rays through part of image.
+// Point p is inside if dot(n[i], p) + d[i] >= 0 for every plane
+#define FRUSTUM_PLANE_COUNT 5
+typedef struct {
+    Vec3 n[FRUSTUM_PLANE_COUNT];
+    f32 d[FRUSTUM_PLANE_COUNT];
+    // Direction of ray through center
+    Vec3 view_dir;
+} Frustum;
+
+typedef enum {
+    FrustumTest_Outside,
+    FrustumTest_Intersects,
+    FrustumTest_Inside,
+} FrustumTest;
+
+// Frustum of rays made by camera_make_ray for u in [u_min, u_max] and v in [v_min, v_max], for any lens sample.
+// Camera does not move during exposure, so rays of any time are covered.
+// Returns false for environment camera, which has no such frustum
+bool camera_make_frustum(Camera *camera, f32 u_min, f32 v_min, f32 u_max, f32 v_max, Frustum *frustum);
+FrustumTest frustum_test_bounds(Frustum *frustum, Bounds3 bounds);
+
 typedef struct { u64 v; } TextureHandle;
 
 typedef u32 TextureType;
@@ -139,6 +177,7 @@ typedef enum {
     MaterialType_Dielectric,
     MaterialType_DiffuseLight,
     MaterialType_Isotropic,
+    MaterialType_Count
 } MaterialType;
 
 typedef enum {
@@ -169,6 +208,9 @@ typedef struct {
     u64 capacity;
 
     MemoryArena *arena;
+    // Bounds of objects in list, valid if bounds_version matches one of world
+    Bounds3 bounds;
+    u64 bounds_version;
 #if RAY_INTERNAL
     bool is_initialized;    
 #endif 
@@ -192,19 +234,47 @@ typedef enum {
     ObjectType_AnimatedTransform,
     
     ObjectType_BVH,
+    ObjectType_InstanceBVH,
+    ObjectType_MotionBVH,
     
     ObjectType_ConstantMedium,
     ObjectType_Box,
 } ObjectType;
 
+// Object placed in world with transform. 
+// Instances can share same object, so memory taken by geometry does not depend on instance count
 typedef struct {
-    Bounds3 bounds;
-    union {
-        u32 obj_offset;       // leaf
-        u32 sec_child_offset; // interior
+    Transform t;
+    ObjectHandle obj;
+    // If set, material of instanced object is replaced with mat
+    bool override_mat;
+    MaterialHandle mat;
+} ObjectInstance;
+
+static inline ObjectInstance 
+make_instance(ObjectHandle obj, Transform t) {
+    return (ObjectInstance) {
+        .t = t,
+        .obj = obj
+    };
+}
+
+static inline ObjectInstance 
+make_instance_mat(ObjectHandle obj, Transform t, MaterialHandle mat) {
+    return (ObjectInstance) {
+        .t = t,
+        .obj = obj,
+        .override_mat = true,
+        .mat = mat
     };
-    u16 nobj;
-} BVHNode;
+}
+
+// Hierarchy over objects in time segment of motion hierarchy
+typedef struct {
+    BVH tree;
+    // Objects in order they are referenced by tree leaves
+    ObjectHandle *objs;
+} MotionBVHSegment;
 
 typedef struct {
     ObjectType type;
@@ -229,6 +299,9 @@ typedef struct {
             ObjectHandle boundary;
             MaterialHandle phase_function;
             f32 neg_inv_density;
+            // Cached bounds of boundary, see ObjectList
+            Bounds3 bounds;
+            u64 bounds_version;
         } constant_medium;
         struct {
             ObjectHandle obj;
@@ -236,13 +309,26 @@ typedef struct {
             Bounds3 bounds;
         } transform;
         struct {
-            ObjectHandle left;
-            ObjectHandle right;
-            Bounds3 bounds;
-        } bvh_node;
+            BVH tree;
+            // Objects in order they are referenced by tree leaves
+            ObjectHandle *objs;
+        } bvh;
+        // Top-level hierarchy over instances
+        struct {
+            BVH tree;
+            // Instances in order they are referenced by tree leaves
+            ObjectInstance *instances;
+        } instance_bvh;
+        struct {
+            // Time range is split into segment_count equal segments with separate hierarchies,
+            // so objects moving fast are not grouped by bounds of their whole path
+            f32 time[2];
+            u32 segment_count;
+            MotionBVHSegment *segments;
+        } motion_bvh;
         struct {
             Bounds3 bounds;
-            ObjectHandle sides;
+            MaterialHandle mat;
         } box;
         struct {
             f32 time[2];
@@ -259,6 +345,10 @@ typedef struct {
             Vec2 *uv;
             MaterialHandle mat;
             Bounds3 bounds;
+            // Hierarchy over triangles of mesh
+            BVH bvh;
+            // Triangles referenced by bvh->prims, rebuilt when hierarchy changes
+            TriangleSoA soa;
             
             f32 surface_area;
         } triangle_mesh;
@@ -266,7 +356,12 @@ typedef struct {
     };
 } Object;
 
-typedef struct {
+struct World;
+// Moves animated objects of scene to given time and updates hierarchies over them, see object_refit_bvh
+#define SCENE_UPDATE_PROC_SIGNATURE(_name) void _name(struct World *world, f32 time)
+typedef SCENE_UPDATE_PROC_SIGNATURE(SceneUpdateProc);
+
+typedef struct World {
     // Arena used to allocate all arrays of world into.
     // Due to a excessive use of dynamic arrays, currently a lot of memory is being wasted,
     // but whatever 
@@ -289,10 +384,28 @@ typedef struct {
     bool has_importance_sampling;
     // List of objects in scene
     ObjectHandle obj_list;
+    // Set by world_commit, after that no objects can be added
+    bool is_committed;
+    // Set by scenes with animation, called by world_update between frames
+    SceneUpdateProc *update_scene;
+    // Bounds of object lists and media are computed recursively, so they are cached. 
+    // Changing version invalidates all cached bounds
+    u64 bounds_version;
+    // Settings used for all acceleration structures built in world
+    BVHBuildSettings bvh_settings;
+    // Memory taken by nodes of all acceleration structures, total and only traversed ones
+    u64 bvh_node_memory;
+    u64 bvh_traversal_node_memory;
 } World;
 
 void world_init(World *world);
 bool validate_world(World *world);
+// Prepares world for rendering after scene setup: root object list is replaced with hierarchy over its objects,
+// so scenes don't fall back to testing every object. World can't be modified after that
+void world_commit(World *world);
+// Advances committed world to time of next frame. Objects are moved by update_scene of world, 
+// then root hierarchy is refitted, so frame is rendered without building acceleration structures from scratch
+void world_update(World *world, f32 time);
 
 Texture  *get_texture(World *world, TextureHandle h);
 Material *get_material(World *world, MaterialHandle h);
@@ -305,6 +418,8 @@ ObjectHandle   new_object(World *world, Object obj);
 ObjectHandle add_object(World *world, ObjectHandle list_handle, ObjectHandle o);
 ObjectHandle add_object_to_world(World *world, ObjectHandle o);
 ObjectHandle add_important_object(World *world, ObjectHandle o);
+// Must be called after geometry of objects is changed directly, so cached bounds are recomputed
+void world_invalidate_bounds(World *world);
 
 TextureHandle texture_solid(World *world, Vec3 c);
 TextureHandle texture_checkerboard(World *world, TextureHandle t1, TextureHandle t2);
@@ -332,6 +447,13 @@ ObjectHandle object_box(World *world, Vec3 min, Vec3 max, MaterialHandle mat);
 ObjectHandle object_constant_medium(World *world, f32 d, MaterialHandle phase, ObjectHandle bound);
 // ObjectHandle object_bvh_node(World *world, ObjectList obj_list, u64 start, u64 end);
 ObjectHandle object_bvh_node(World *world, ObjectHandle *objs, i64 n);
+ObjectHandle object_instance_bvh(World *world, ObjectInstance *instances, u32 n);
+// Hierarchy over moving objects, which are expected to be hit only by rays with time in range [time0, time1].
+// Node bounds are interpolated by ray time, so ray is tested against bounds objects have at that time
+ObjectHandle object_motion_bvh(World *world, ObjectHandle *objs, u32 n, f32 time0, f32 time1);
+// Updates hierarchy of BVH, instance BVH or triangle mesh after its primitives have moved.
+// Hierarchy is refitted, or rebuilt if refitting degraded its quality too much. Returns true if it was rebuilt
+bool object_refit_bvh(World *world, ObjectHandle obj_handle);
 ObjectHandle object_animated_transform(World *world, ObjectHandle obj, f32 time0, f32 time1, 
                                       Vec3 t0, Vec3 t1, Quat4 r0, Quat4 r1);
 #define object_triangle_mesh_p(_world, _pm, _mat) object_triangle_mesh_pt(_world, _pm, _mat, EMPTY_TRANSFORM)